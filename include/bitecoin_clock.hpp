@@ -0,0 +1,91 @@
+#ifndef  bitecoin_clock_hpp
+#define  bitecoin_clock_hpp
+
+#include <cstdint>
+
+#include <algorithm>
+
+#include "bitecoin_protocol.hpp"
+
+namespace bitecoin{
+
+/*! Estimates the offset between our clock and the server's from ping/pong exchanges, in
+	the same way as NTP. Each exchange gives an offset and a round trip time, and the
+	offset can only be wrong by up to half of the round trip, so the sample with the
+	smallest round trip in the recent window is the one that is believed. Samples that
+	were held up by queueing anywhere on the way are simply ignored.
+*/
+class ClockEstimator
+{
+private:
+	// How many of the most recent samples are considered
+	enum{ WINDOW = 64 };
+
+	struct sample_t
+	{
+		double offset;	// Server clock minus our clock, in seconds
+		double rtt;		// Round trip excluding time spent in the server, in seconds
+	};
+
+	// Ring buffer of the last WINDOW samples, so adding one never allocates
+	sample_t m_samples[WINDOW];
+	unsigned m_count;
+	unsigned m_next;
+	
+	const sample_t &Best() const
+	{
+		return *std::min_element(m_samples, m_samples+m_count, [](const sample_t &a, const sample_t &b){
+			return a.rtt < b.rtt;
+		});
+	}
+public:
+	ClockEstimator()
+		: m_count(0)
+		, m_next(0)
+	{}
+	
+	/*! t0 and t3 are our send and receive times, t1 and t2 are the server's receive and
+		send times. */
+	void AddSample(timestamp_t t0, timestamp_t t1, timestamp_t t2, timestamp_t t3)
+	{
+		// Take differences as integers first, the absolute times are too big for a double
+		sample_t s;
+		s.offset=0.5*( double(int64_t(t1-t0)) + double(int64_t(t2-t3)) )*1e-9;
+		s.rtt=( double(int64_t(t3-t0)) - double(int64_t(t2-t1)) )*1e-9;
+		if(s.rtt<0)
+			s.rtt=0;	// Only possible if one of the clocks went backwards
+		m_samples[m_next]=s;
+		m_next=(m_next+1)%WINDOW;
+		m_count=std::min(m_count+1, unsigned(WINDOW));
+	}
+
+	bool Valid() const
+	{ return m_count>0; }
+
+	unsigned Count() const
+	{ return m_count; }
+
+	//! Server clock minus our clock, taken from the best sample
+	double Offset() const
+	{ return Best().offset; }
+
+	double MinRtt() const
+	{ return Best().rtt; }
+
+	//! How much worse than the best a typical round trip is, using the 90th percentile
+	double RttJitter() const
+	{
+		// On the stack, as this is asked for every time a pong arrives
+		double rtts[WINDOW];
+		unsigned n=m_count;
+		for(unsigned i=0;i<n;i++){
+			rtts[i]=m_samples[i].rtt;
+		}
+		std::sort(rtts, rtts+n);
+		return rtts[(n*9)/10]-rtts[0];
+	}
+};
+
+}; // bitecoin
+
+#endif
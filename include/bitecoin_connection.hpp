@@ -11,6 +11,8 @@
 
 #include <vector>
 #include <memory>
+#include <string>
+#include <utility>
 
 #if defined(_WIN32) || defined(_WIN64)
 #include "Winsock2.h"
@@ -18,7 +20,65 @@
 #include <arpa/inet.h>
 #endif
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include "bitecoin_connection_stats.hpp"
+
 namespace bitecoin{
+
+	namespace detail{
+		
+		/*! Convert n 32-bit words between host and network order. Used to move whole arrays
+			of words in one go rather than one htonl and one Send per element.
+			\note dst and src can be the same */
+		void swap_words(unsigned n, uint32_t *dst, const uint32_t *src)
+		{
+			unsigned i=0;
+#if defined(__SSSE3__)
+			// x86 is always little-endian, so this is a byte reversal within each word
+			const __m128i shuffle=_mm_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+			for(;i+4<=n;i+=4){
+				__m128i x=_mm_loadu_si128((const __m128i*)(src+i));
+				_mm_storeu_si128((__m128i*)(dst+i), _mm_shuffle_epi8(x, shuffle));
+			}
+#endif
+			for(;i<n;i++){
+				dst[i]=htonl(src[i]);
+			}
+		}
+		
+		/*! Allocator that leaves new elements uninitialised when a vector grows, for buffers
+			that are about to be overwritten by a Recv anyway. Otherwise resize zero-fills. */
+		template<class T>
+		struct default_init_allocator
+			: public std::allocator<T>
+		{
+			template<class U>
+			struct rebind
+			{ typedef default_init_allocator<U> other; };
+			
+			default_init_allocator()
+			{}
+			
+			template<class U>
+			default_init_allocator(const default_init_allocator<U> &)
+			{}
+			
+			template<class U>
+			void construct(U *p)
+			{ ::new((void*)p) U; }
+			
+			template<class U, class... Args>
+			void construct(U *p, Args&&... args)
+			{ ::new((void*)p) U(std::forward<Args>(args)...); }
+		};
+		
+	}; // detail
+	
+	//! Bytes that are received straight into place, without zeroing them first
+	typedef std::vector<uint8_t, detail::default_init_allocator<uint8_t> > byte_vector_t;
 	
 class Connection
 {
@@ -26,6 +86,11 @@ private:
 	// No implementaton for either
 	Connection(const Connection &); // = delete;
 	Connection &operator=(const Connection &); // = delete;
+	
+	// Scratch space for putting words into network order before sending, kept to avoid reallocating
+	std::vector<uint32_t> m_swapBuffer;
+	
+	ConnectionStats m_stats;
 
 	void CheckString(unsigned n, const char *data) const
 	{
@@ -44,9 +109,38 @@ public:
 	virtual void Send(size_t cbData, const void *pData) =0;
 	virtual void Recv(size_t cbData, void *pData) =0;
 	
+	//! Connections may hold back sent data until this is called. EndPacket calls it once the packet is complete.
+	virtual void Flush()
+	{}
+	
+	/*! Makes a Recv that is blocked in another thread throw, and any Recv after it, so
+		that thread can be joined before the connection is destroyed. Can be called from
+		any thread. Nothing is freed until the destructor. Connections that never block
+		don't need to do anything. */
+	virtual void Shutdown()
+	{}
+	
+	/*! Packet framing. The header goes before the payload and the footer after it. Both
+		buffers must stay valid until EndPacket returns, so a connection which holds back
+		the payload can write header, payload and footer in one gathered call. */
+	virtual void BeginPacket(size_t cbHeader, const void *pHeader)
+	{
+		Send(cbHeader, pHeader);
+	}
+	
+	virtual void EndPacket(size_t cbFooter, const void *pFooter)
+	{
+		Send(cbFooter, pFooter);
+		Flush();
+	}
+	
 	//! Return the current offset from some arbitrary starting point		
 	virtual uint64_t SendOffset() const =0;
 	virtual uint64_t RecvOffset() const =0;
+	
+	//! Counters for this connection. A connection that wraps another should return the inner one's.
+	virtual ConnectionStats &Stats()
+	{ return m_stats; }
 		
 	void Send(uint32_t val)
 	{
@@ -74,10 +168,12 @@ public:
 	{
 		uint32_t length=0;
 		Recv(length);
-		std::vector<char> tmp(length, 0);
-		Recv(length, &tmp[0]);
-		CheckString(length, &tmp[0]);
-		val=std::string(tmp.begin(), tmp.end());
+		// Straight into the string, which keeps its capacity if it is being reused
+		val.resize(length);
+		if(length==0)
+			return;
+		Recv(length, &val[0]);
+		CheckString(length, &val[0]);
 	}
 	
 	void Send(uint64_t val)
@@ -123,6 +219,96 @@ public:
 		Recv(length, &v[0]);
 	}
 	
+	void Send(const byte_vector_t &v)
+	{
+		uint32_t length=v.size();
+		if(length!=v.size())
+			throw std::invalid_argument("Connection::Send - Vector has more than 32 elements.");
+		Send(length);
+		Send(length, v.data());
+	}
+	
+	void Recv(byte_vector_t &v)
+	{
+		uint32_t length=0;
+		Recv(length);
+		v.resize(length);
+		if(length==0)
+			return;
+		Recv(length, v.data());
+	}
+	
+	//! Send n words in network order with a single underlying Send
+	void SendWords(unsigned n, const uint32_t *pWords)
+	{
+		if(n==0)
+			return;
+		if(m_swapBuffer.size()<n)
+			m_swapBuffer.resize(n);
+		detail::swap_words(n, &m_swapBuffer[0], pWords);
+		Send(4*n, &m_swapBuffer[0]);
+	}
+	
+	//! Receive n words with a single underlying Recv, then put them in host order
+	void RecvWords(unsigned n, uint32_t *pWords)
+	{
+		if(n==0)
+			return;
+		Recv(4*n, pWords);
+		detail::swap_words(n, pWords, pWords);
+	}
+	
+	void Send(const std::vector<uint32_t> &v)
+	{
+		uint32_t length=v.size();
+		if(length!=v.size())
+			throw std::invalid_argument("Connection::Send - Vector has more than 32 elements.");
+		Send(length);
+		SendWords(length, v.data());
+	}
+	
+	void Recv(std::vector<uint32_t> &v)
+	{
+		uint32_t length=0;
+		Recv(length);
+		v.resize(length);
+		RecvWords(length, v.data());
+	}
+	
+	// On the wire each element is the high word then the low word, so it is
+	// the same as sending twice as many words
+	void Send(const std::vector<uint64_t> &v)
+	{
+		uint32_t length=v.size();
+		if(length!=v.size())
+			throw std::invalid_argument("Connection::Send - Vector has more than 32 elements.");
+		Send(length);
+		if(length==0)
+			return;
+		if(m_swapBuffer.size()<2*length)
+			m_swapBuffer.resize(2*length);
+		for(unsigned i=0;i<length;i++){
+			m_swapBuffer[2*i]=htonl(uint32_t(v[i]>>32));
+			m_swapBuffer[2*i+1]=htonl(uint32_t(v[i]&0xFFFFFFFFull));
+		}
+		Send(8*length, &m_swapBuffer[0]);
+	}
+	
+	void Recv(std::vector<uint64_t> &v)
+	{
+		uint32_t length=0;
+		Recv(length);
+		v.resize(length);
+		if(length==0)
+			return;
+		Recv(8*length, v.data());
+		const uint32_t *pWords=(const uint32_t*)v.data();
+		for(unsigned i=0;i<length;i++){
+			uint32_t hi=ntohl(pWords[2*i]), lo=ntohl(pWords[2*i+1]);
+			v[i]=(((uint64_t)hi)<<32) | lo;
+		}
+	}
+	
 	template<class T>
 	void Send(const std::vector<T> &v)
 	{
@@ -149,6 +335,11 @@ public:
 
 std::unique_ptr<Connection> OpenConnection_File(std::vector<std::string> &spec);
 std::unique_ptr<Connection> OpenConnection_Socket(std::vector<std::string> &spec);
+std::unique_ptr<Connection> OpenConnection_Shm(std::vector<std::string> &spec);
+// These two know about packets, so they come in with bitecoin_protocol.hpp
+std::unique_ptr<Connection> OpenConnection_Record(std::vector<std::string> &spec);
+std::unique_ptr<Connection> OpenConnection_Replay(std::vector<std::string> &spec);
+std::unique_ptr<Connection> OpenConnection_Sim(std::vector<std::string> &spec);
 
 std::unique_ptr<Connection> OpenConnection(std::vector<std::string> &spec)
 {
@@ -157,8 +348,16 @@ std::unique_ptr<Connection> OpenConnection(std::vector<std::string> &spec)
 	
 	if(spec[0]=="file"){
 		return OpenConnection_File(spec);
-	}else if(spec[0]=="tcp-server" || spec[0]=="tcp-client"){
+	}else if(spec[0]=="tcp-server" || spec[0]=="tcp-client" || spec[0]=="unix-server" || spec[0]=="unix-client"){
 		return OpenConnection_Socket(spec);
+	}else if(spec[0]=="shm"){
+		return OpenConnection_Shm(spec);
+	}else if(spec[0]=="record"){
+		return OpenConnection_Record(spec);
+	}else if(spec[0]=="replay"){
+		return OpenConnection_Replay(spec);
+	}else if(spec[0]=="sim"){
+		return OpenConnection_Sim(spec);
 	}else{
 		throw std::invalid_argument("OpenConnection - Didn't understand connection header '"+spec[0]+"'.");
 	}
@@ -193,7 +392,8 @@ std::unique_ptr<Connection> OpenConnection(std::vector<std::string> &spec)
 				return m_acc;
 			}
 			
-			~throw_helper()
+			// Destructors are noexcept by default in C++11, which would turn the throw into terminate
+			~throw_helper() noexcept(false)
 			{
 				if(m_valid)
 					throw TException(m_acc.str());
@@ -208,7 +408,10 @@ std::unique_ptr<Connection> OpenConnection(std::vector<std::string> &spec)
 
 }; // bitecoin
 
+#include "bitecoin_connection_buffered.hpp"
 #include "bitecoin_connection_file.hpp"
 #include "bitecoin_connection_socket.hpp"
+#include "bitecoin_connection_shm.hpp"
+#include "bitecoin_connection_memory.hpp"
 
 #endif
@@ -0,0 +1,219 @@
+#ifndef bitecoin_connection_buffered_hpp
+#define bitecoin_connection_buffered_hpp
+
+#include "bitecoin_connection.hpp"
+
+#include <algorithm>
+
+#if defined(_WIN32) || defined(_WIN64)
+struct iovec
+{
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+namespace bitecoin{
+
+namespace detail{
+
+/*! Common base for connections over a file descriptor or similar. A packet's payload is
+	accumulated in memory, and when the packet ends the header, payload and footer are
+	written with one gathered call, so a whole packet goes out in one system call rather
+	than one per field. In the other direction each read asks for as much as will fit in the
+	receive buffer, and fields are then decoded from memory. Derived classes just provide
+	the raw reads and writes.
+	
+	Sends only go out at EndPacket or Flush, and receiving never flushes, so one thread
+	can be sending while another receives. */
+class ConnectionBuffered
+	: public Connection
+{
+private:
+	// If a single packet gets this big we write out what we have so far
+	enum{ SEND_FLUSH_THRESHOLD = 1<<16 };
+	// Most we will read ahead of what has been asked for
+	enum{ RECV_BUFFER_SIZE = 1<<16 };
+
+	std::vector<uint8_t> m_sendBuffer;
+	std::vector<uint8_t> m_recvBuffer;
+	size_t m_recvBegin, m_recvEnd;	// Unconsumed bytes are [m_recvBegin,m_recvEnd) of m_recvBuffer
+	uint64_t m_sendOffset, m_recvOffset;
+	
+	// Header of the packet being sent, until it has been written out
+	const void *m_pHeader;
+	size_t m_cbHeader;
+
+	//! Write all of the parts, coping with partial writes. Modifies the parts as it goes.
+	void SendAllV(unsigned n, struct iovec *parts)
+	{
+		while(n){
+			if(parts->iov_len==0){
+				parts++;
+				n--;
+				continue;
+			}
+			uint64_t t0=ConnectionStats::Clock();
+			size_t done=RawSendV(n, parts);
+			Stats().OnSendCall(done, ConnectionStats::Clock()-t0);
+			while(done){
+				size_t step=std::min(done, parts->iov_len);
+				parts->iov_base=(uint8_t*)parts->iov_base+step;
+				parts->iov_len-=step;
+				done-=step;
+				if(parts->iov_len==0){
+					parts++;
+					n--;
+				}
+			}
+		}
+	}
+protected:
+	ConnectionBuffered()
+		: m_recvBuffer(RECV_BUFFER_SIZE)
+		, m_recvBegin(0)
+		, m_recvEnd(0)
+		, m_sendOffset(0)
+		, m_recvOffset(0)
+		, m_pHeader(0)
+		, m_cbHeader(0)
+	{
+		m_sendBuffer.reserve(SEND_FLUSH_THRESHOLD);
+	}
+
+	//! Write between 1 and cbData bytes, returning the number written. Throws on error.
+	virtual size_t RawSend(size_t cbData, const void *pData) =0;
+	
+	/*! Write between 1 byte and all of the parts, returning the number written. Throws on error.
+		\note The first part is never empty. The default just writes the first part. */
+	virtual size_t RawSendV(unsigned n, const struct iovec *parts)
+	{
+		if(n==0)
+			throw std::logic_error("RawSendV - No parts to send.");
+		return RawSend(parts[0].iov_len, parts[0].iov_base);
+	}
+
+	//! Read between 1 and cbData bytes, returning the number read. Throws on error or end of stream.
+	virtual size_t RawRecv(size_t cbData, void *pData) =0;
+public:
+	virtual void Send(size_t cbData, const void *pData) override
+	{
+		if(cbData > 0x7FFFFFFFUL)
+			throw std::logic_error("SendPacket - 64-bit packet lengths not tested.");
+
+		const uint8_t *pWrite=(const uint8_t *)pData;
+		m_sendBuffer.insert(m_sendBuffer.end(), pWrite, pWrite+cbData);
+		m_sendOffset+=cbData;
+
+		if(m_sendBuffer.size() >= SEND_FLUSH_THRESHOLD)
+			Flush();
+	}
+
+	virtual void Flush() override
+	{
+		struct iovec parts[2];
+		unsigned n=0;
+		if(m_pHeader){
+			parts[n].iov_base=(void*)m_pHeader;
+			parts[n].iov_len=m_cbHeader;
+			n++;
+			m_pHeader=0;
+		}
+		if(!m_sendBuffer.empty()){
+			parts[n].iov_base=&m_sendBuffer[0];
+			parts[n].iov_len=m_sendBuffer.size();
+			n++;
+		}
+		SendAllV(n, parts);
+		m_sendBuffer.clear();
+	}
+	
+	virtual void BeginPacket(size_t cbHeader, const void *pHeader) override
+	{
+		if(m_pHeader)
+			throw std::logic_error("ConnectionBuffered::BeginPacket - Previous packet was never finished.");
+		Flush();
+		m_pHeader=pHeader;
+		m_cbHeader=cbHeader;
+		m_sendOffset+=cbHeader;
+	}
+	
+	virtual void EndPacket(size_t cbFooter, const void *pFooter) override
+	{
+		struct iovec parts[3];
+		unsigned n=0;
+		if(m_pHeader){
+			parts[n].iov_base=(void*)m_pHeader;
+			parts[n].iov_len=m_cbHeader;
+			n++;
+			m_pHeader=0;
+		}
+		if(!m_sendBuffer.empty()){
+			parts[n].iov_base=&m_sendBuffer[0];
+			parts[n].iov_len=m_sendBuffer.size();
+			n++;
+		}
+		parts[n].iov_base=(void*)pFooter;
+		parts[n].iov_len=cbFooter;
+		n++;
+		m_sendOffset+=cbFooter;
+		
+		SendAllV(n, parts);
+		m_sendBuffer.clear();
+	}
+
+	virtual void Recv(size_t cbData, void *pData) override
+	{
+		uint8_t *pRead=(uint8_t*)pData;
+		
+		// Usually everything is already here
+		size_t avail=m_recvEnd-m_recvBegin;
+		if(cbData<=avail){
+			memcpy(pRead, &m_recvBuffer[m_recvBegin], cbData);
+			m_recvBegin+=cbData;
+			m_recvOffset+=cbData;
+			return;
+		}
+		
+		memcpy(pRead, &m_recvBuffer[m_recvBegin], avail);
+		pRead += avail;
+		uint64_t todo=cbData-avail;
+		m_recvOffset+=avail;
+		m_recvBegin=m_recvEnd=0;
+
+		while(todo){
+			size_t done;
+			uint64_t t0=ConnectionStats::Clock();
+			if(todo >= RECV_BUFFER_SIZE){
+				// Big reads go straight to the destination
+				done=RawRecv(todo, pRead);
+				Stats().OnRecvCall(done, ConnectionStats::Clock()-t0);
+			}else{
+				// Otherwise grab whatever is available, and keep the excess
+				m_recvEnd=RawRecv(RECV_BUFFER_SIZE, &m_recvBuffer[0]);
+				Stats().OnRecvCall(m_recvEnd, ConnectionStats::Clock()-t0);
+				done=std::min<size_t>(m_recvEnd, todo);
+				memcpy(pRead, &m_recvBuffer[0], done);
+				m_recvBegin=done;
+			}
+			m_recvOffset+=done;
+			pRead += done;
+			todo -= done;
+		}
+	}
+
+	virtual uint64_t SendOffset() const override
+	{ return m_sendOffset; }
+
+	//! Counts bytes handed out by Recv, not bytes read ahead from the underlying stream
+	virtual uint64_t RecvOffset() const override
+	{ return m_recvOffset; }
+};
+
+}; // detail
+
+}; // bitecoin
+
+#endif
@@ -2,6 +2,7 @@
 #define bitecoin_connection_file_hpp
 
 #include "bitecoin_connection.hpp"
+#include "bitecoin_connection_buffered.hpp"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -17,6 +18,7 @@
 #define O_BINARY 0
 #endif
 #include <unistd.h>
+#include <poll.h>
 void set_binary_io()
 {}
 #else
@@ -44,81 +46,115 @@ namespace bitecoin{
 namespace detail{
 	
 class ConnectionOverFile
-	: public Connection
+	: public ConnectionBuffered
 {
 private:	
 	friend std::unique_ptr<Connection> bitecoin::OpenConnection_File(std::vector<std::string> &spec);
 
 	int m_fdSend, m_fdRecv;
-	uint64_t m_sendOffset, m_recvOffset;
+	
+#if !(defined(_WIN32) || defined(_WIN64))
+	// Closing a pipe doesn't wake a read blocked on it, so RawRecv also waits on this
+	// one, which Shutdown writes to
+	int m_fdWake[2];
+#endif
 
 	ConnectionOverFile(int fdSend, int fdRecv)
 		: m_fdSend(fdSend)
 		, m_fdRecv(fdRecv)
-		, m_sendOffset(0)
-		, m_recvOffset(0)
 	{
 		if(fdSend==-1 || fdRecv==-1)
 			throw std::invalid_argument("ConnectionOverFile - one of the file descriptors is invalid.");
+#if !(defined(_WIN32) || defined(_WIN64))
+		if(pipe(m_fdWake)!=0){
+			int e=errno;
+			std::stringstream acc;
+			acc<<"ConnectionOverFile - Couldn't create wake pipe ("<<e<<" = "<<strerror(e)<<")";
+			throw std::runtime_error(acc.str());
+		}
+#endif
 	}
 	
 	~ConnectionOverFile()
 	{
 		close(m_fdSend);
 		close(m_fdRecv);
+#if !(defined(_WIN32) || defined(_WIN64))
+		close(m_fdWake[0]);
+		close(m_fdWake[1]);
+#endif
 	}
 public:
 	std::unique_ptr<Connection> Create(int fdSend, int fdRecv)
 	{
 		return std::unique_ptr<Connection>(new ConnectionOverFile(fdSend, fdRecv));
 	}
+	
+#if !(defined(_WIN32) || defined(_WIN64))
+	//! The wake pipe is never read, so every RawRecv from now on fails
+	virtual void Shutdown() override
+	{
+		char c=0;
+		if(write(m_fdWake[1], &c, 1)!=1)
+			fprintf(stderr, "ConnectionOverFile::Shutdown - Couldn't write to wake pipe, errno=%d\n", errno);
+	}
+#endif
 
-	virtual void Send(size_t cbData, const void *pData) override
+protected:
+	virtual size_t RawSend(size_t cbData, const void *pData) override
 	{
-		if(cbData > 0x7FFFFFFFUL)
-			throw std::logic_error("SendPacket - 64-bit packet lengths not tested.");
-		
-		const uint8_t *pWrite=(const uint8_t *)pData;
-		
-		uint64_t todo=cbData;
-		while(todo){
-			int done=write(m_fdSend, pWrite, todo);
-			if(done<=0){
-				int e=errno;
-				std::stringstream acc;
-				acc<<"Send - Received error while reading writing to file ("<<e<<" = "<<strerror(e)<<")";
-				throw std::runtime_error(acc.str());
-			}
-			m_sendOffset+=done;
-			pWrite += done;
-			todo -= done;
+		int done=write(m_fdSend, pData, cbData);
+		if(done<=0){
+			int e=errno;
+			std::stringstream acc;
+			acc<<"Send - Received error while reading writing to file ("<<e<<" = "<<strerror(e)<<")";
+			throw std::runtime_error(acc.str());
 		}
+		return done;
 	}
 	
-	virtual void Recv(size_t cbData, void *pData) override
+#if !(defined(_WIN32) || defined(_WIN64))
+	virtual size_t RawSendV(unsigned n, const struct iovec *parts) override
 	{
-		uint8_t *pRead=(uint8_t*)pData;
-		
-		uint64_t todo=cbData;
-		while(todo){
-			int done=read(m_fdRecv, pRead, todo);
-			if(done<=0){
-				int e=errno;
+		ssize_t done=writev(m_fdSend, parts, n);
+		if(done<=0){
+			int e=errno;
+			std::stringstream acc;
+			acc<<"Send - Received error while reading writing to file ("<<e<<" = "<<strerror(e)<<")";
+			throw std::runtime_error(acc.str());
+		}
+		return done;
+	}
+#endif
+	
+	virtual size_t RawRecv(size_t cbData, void *pData) override
+	{
+#if !(defined(_WIN32) || defined(_WIN64))
+		struct pollfd fds[2];
+		fds[0].fd=m_fdRecv;
+		fds[0].events=POLLIN;
+		fds[1].fd=m_fdWake[0];
+		fds[1].events=POLLIN;
+		while(poll(fds, 2, -1)<0){
+			int e=errno;
+			if(e!=EINTR){
 				std::stringstream acc;
-				acc<<"Recv - Received error while reading reading from file ("<<e<<" = "<<strerror(e)<<")";
+				acc<<"Recv - Received error while waiting for file ("<<e<<" = "<<strerror(e)<<")";
 				throw std::runtime_error(acc.str());
 			}
-			m_recvOffset+=done;
-			pRead += done;
-			todo -= done;
 		}
+		if(fds[1].revents)
+			throw std::runtime_error("Recv - Connection has been shut down.");
+#endif
+		int done=read(m_fdRecv, pData, cbData);
+		if(done<=0){
+			int e=errno;
+			std::stringstream acc;
+			acc<<"Recv - Received error while reading reading from file ("<<e<<" = "<<strerror(e)<<")";
+			throw std::runtime_error(acc.str());
+		}
+		return done;
 	}
-	
-	virtual uint64_t SendOffset() const override
-	{ return m_sendOffset; }
-	
-	virtual uint64_t RecvOffset() const override
-	{ return m_recvOffset; }
 };
 
 }; // detail
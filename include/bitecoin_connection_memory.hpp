@@ -0,0 +1,72 @@
+#ifndef bitecoin_connection_memory_hpp
+#define bitecoin_connection_memory_hpp
+
+#include "bitecoin_connection.hpp"
+
+namespace bitecoin{
+
+namespace detail{
+
+/*! A connection where sends go to a byte vector and receives come from a block of memory.
+	Used to encode a packet once and then hand the bytes to many sockets, or to decode
+	a packet that has already been read completely by something else. */
+class ConnectionOverMemory
+	: public Connection
+{
+private:
+	std::vector<uint8_t> m_sendBuffer;
+	const uint8_t *m_pRecvBegin, *m_pRecvEnd;
+	uint64_t m_recvOffset;
+public:
+	ConnectionOverMemory()
+		: m_pRecvBegin(0)
+		, m_pRecvEnd(0)
+		, m_recvOffset(0)
+	{}
+
+	//! Everything sent so far
+	const std::vector<uint8_t> &Sent() const
+	{ return m_sendBuffer; }
+
+	//! Start again with nothing sent, keeping the memory
+	void ClearSent()
+	{ m_sendBuffer.clear(); }
+
+	//! Receives will come from [pBegin,pBegin+cbData), which must stay valid while in use
+	void SetRecvData(size_t cbData, const void *pData)
+	{
+		m_pRecvBegin=(const uint8_t*)pData;
+		m_pRecvEnd=m_pRecvBegin+cbData;
+	}
+
+	//! How much of the receive data has not been consumed yet
+	size_t RecvRemaining() const
+	{ return m_pRecvEnd-m_pRecvBegin; }
+
+	virtual void Send(size_t cbData, const void *pData) override
+	{
+		const uint8_t *pWrite=(const uint8_t*)pData;
+		m_sendBuffer.insert(m_sendBuffer.end(), pWrite, pWrite+cbData);
+	}
+
+	virtual void Recv(size_t cbData, void *pData) override
+	{
+		if(cbData > RecvRemaining())
+			throw std::runtime_error("ConnectionOverMemory::Recv - Read past the end of the data.");
+		memcpy(pData, m_pRecvBegin, cbData);
+		m_pRecvBegin+=cbData;
+		m_recvOffset+=cbData;
+	}
+
+	virtual uint64_t SendOffset() const override
+	{ return m_sendBuffer.size(); }
+
+	virtual uint64_t RecvOffset() const override
+	{ return m_recvOffset; }
+};
+
+}; // detail
+
+}; // bitecoin
+
+#endif
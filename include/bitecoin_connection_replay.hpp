@@ -0,0 +1,435 @@
+#ifndef bitecoin_connection_replay_hpp
+#define bitecoin_connection_replay_hpp
+
+#include "bitecoin_protocol.hpp"
+#include "wide_int.h"
+
+#include <cstdio>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+namespace bitecoin{
+
+namespace detail{
+
+/* A recording starts with REPLAY_MAGIC, and then each packet received is written as an
+	8 byte arrival time (big endian, nanoseconds on the recorder's clock) followed by the
+	packet exactly as it came off the wire. Packets carry their own length, so there is
+	nothing else. Only what was received is kept, as that is all a replay needs.
+*/
+const char REPLAY_MAGIC[8]={'B','T','C','R','E','C','0','1'};
+
+uint64_t ReadBigEndian64(const uint8_t *p)
+{
+	uint64_t res=0;
+	for(unsigned i=0;i<8;i++){
+		res=(res<<8) | p[i];
+	}
+	return res;
+}
+
+void WriteBigEndian64(uint8_t *p, uint64_t x)
+{
+	for(int i=7;i>=0;i--){
+		p[i]=uint8_t(x&0xFF);
+		x>>=8;
+	}
+}
+
+/*! Passes everything through to another connection, and writes each packet that is
+	received to a recording. Packets are stamped when their last byte arrives. */
+class ConnectionRecord
+	: public Connection
+{
+private:
+	std::unique_ptr<Connection> m_inner;
+	FILE *m_file;
+	std::vector<uint8_t> m_packet;	// What has been received of the current packet
+public:
+	ConnectionRecord(std::unique_ptr<Connection> &inner, const std::string &path)
+		: m_inner(std::move(inner))
+		, m_file(fopen(path.c_str(), "wb"))
+	{
+		if(!m_file)
+			throw std::runtime_error("ConnectionRecord - Couldn't open '"+path+"' for writing.");
+		if(1!=fwrite(REPLAY_MAGIC, sizeof(REPLAY_MAGIC), 1, m_file)){
+			fclose(m_file);
+			throw std::runtime_error("ConnectionRecord - Couldn't write to '"+path+"'.");
+		}
+	}
+
+	~ConnectionRecord()
+	{
+		fclose(m_file);
+	}
+
+	virtual void Send(size_t cbData, const void *pData) override
+	{ m_inner->Send(cbData, pData); }
+
+	virtual void Flush() override
+	{ m_inner->Flush(); }
+
+	virtual void BeginPacket(size_t cbHeader, const void *pHeader) override
+	{ m_inner->BeginPacket(cbHeader, pHeader); }
+
+	virtual void EndPacket(size_t cbFooter, const void *pFooter) override
+	{ m_inner->EndPacket(cbFooter, pFooter); }
+
+	virtual void Shutdown() override
+	{ m_inner->Shutdown(); }
+
+	virtual void Recv(size_t cbData, void *pData) override
+	{
+		m_inner->Recv(cbData, pData);
+
+		const uint8_t *pRead=(const uint8_t*)pData;
+		m_packet.insert(m_packet.end(), pRead, pRead+cbData);
+		while(m_packet.size()>=8){
+			uint64_t length=ReadBigEndian64(&m_packet[0]);
+			if(length<20)
+				throw std::runtime_error("ConnectionRecord::Recv - Received packet length of < 20 bytes.");
+			if(m_packet.size()<length)
+				break;
+
+			uint8_t stamp[8];
+			WriteBigEndian64(stamp, now());
+			if(1!=fwrite(stamp, 8, 1, m_file) || 1!=fwrite(&m_packet[0], length, 1, m_file))
+				throw std::runtime_error("ConnectionRecord::Recv - Couldn't write to recording.");
+			// Packets are few and far between, and a session usually ends by being killed
+			fflush(m_file);
+			m_packet.erase(m_packet.begin(), m_packet.begin()+length);
+		}
+	}
+
+	virtual uint64_t SendOffset() const override
+	{ return m_inner->SendOffset(); }
+
+	virtual uint64_t RecvOffset() const override
+	{ return m_inner->RecvOffset(); }
+
+	virtual ConnectionStats &Stats() override
+	{ return m_inner->Stats(); }
+};
+
+/*! Plays back a recording as if it were the server. Anything sent is thrown away, apart
+	from final bids, which are compared with the recorded results round for round.
+
+	Timestamps inside the packets are moved forward to match when they are played back,
+	otherwise the client would think the server's clock was hours behind. With realtime
+	timing every packet arrives as long after the start as it did originally. With fast
+	timing the wait before each round begins is skipped, but the rounds themselves keep
+	their timing, so MakeBid still gets the original bid window. Pongs are dropped in fast
+	mode, as the clock appears to jump between rounds and they would confuse the estimate.
+*/
+class ConnectionReplay
+	: public Connection
+{
+private:
+	struct record_t
+	{
+		timestamp_t timeRecv;	// When the recorder received it
+		size_t offset;		// Into m_data
+		uint64_t length;
+		uint32_t command;
+	};
+
+	std::vector<uint8_t> m_data;
+	std::vector<record_t> m_records;
+	bool m_fast;
+
+	// Receive side
+	unsigned m_next;			// Index of the next record to deliver
+	timestamp_t m_replayStart;	// Our clock when the first packet was due
+	int64_t m_skipped;			// How much of the recording has been skipped in fast mode
+	std::vector<uint8_t> m_current;	// The packet being delivered
+	size_t m_currentPos;
+	uint64_t m_recvOffset;
+
+	// Set by Shutdown, which wakes the wait for the next record
+	std::mutex m_shutdownMutex;
+	std::condition_variable m_shutdownCond;
+	bool m_shutdown;
+
+	// Send side, which may be on another thread
+	std::vector<uint8_t> m_sent;	// Partial packets from the client
+	uint64_t m_sendOffset;
+
+	// Final bids from the client, and how they compared
+	struct proof_t
+	{
+		uint32_t limbs[BIGINT_WORDS];
+	};
+	std::mutex m_bidsMutex;
+	std::map<uint64_t,proof_t> m_bids;
+	unsigned m_compared, m_beatBest, m_beatWinner;
+
+	void Load(const std::string &path)
+	{
+		FILE *file=fopen(path.c_str(), "rb");
+		if(!file)
+			throw std::runtime_error("ConnectionReplay - Couldn't open '"+path+"' for reading.");
+		uint8_t buffer[65536];
+		size_t done;
+		while(0<(done=fread(buffer, 1, sizeof(buffer), file))){
+			m_data.insert(m_data.end(), buffer, buffer+done);
+		}
+		fclose(file);
+
+		if(m_data.size()<sizeof(REPLAY_MAGIC) || memcmp(&m_data[0], REPLAY_MAGIC, sizeof(REPLAY_MAGIC)))
+			throw std::runtime_error("ConnectionReplay - '"+path+"' is not a recording.");
+
+		size_t offset=sizeof(REPLAY_MAGIC);
+		while(offset+8+20 <= m_data.size()){
+			record_t r;
+			r.timeRecv=ReadBigEndian64(&m_data[offset]);
+			r.offset=offset+8;
+			r.length=ReadBigEndian64(&m_data[r.offset]);
+			r.command=(uint32_t(m_data[r.offset+8])<<24) | (uint32_t(m_data[r.offset+9])<<16) | (uint32_t(m_data[r.offset+10])<<8) | m_data[r.offset+11];
+			if(r.length<20 || r.offset+r.length > m_data.size())
+				break;	// Probably cut off by the recorder being killed
+			m_records.push_back(r);
+			offset=r.offset+r.length;
+		}
+		if(m_records.empty())
+			throw std::runtime_error("ConnectionReplay - '"+path+"' has no packets in it.");
+	}
+
+	void Encode(const Packet &packet)
+	{
+		ConnectionOverMemory encoder;
+		packet.Send(&encoder);
+		m_current=encoder.Sent();
+	}
+
+	void CompareResults(const Packet_ServerCompleteRound &results)
+	{
+		proof_t best;
+		wide_ones(BIGINT_WORDS, best.limbs);
+		for(const auto &sub : results.submissions){
+			if(wide_compare(BIGINT_WORDS, sub.proof, best.limbs)<0)
+				wide_copy(BIGINT_WORDS, best.limbs, sub.proof);
+		}
+
+		proof_t ours;
+		{
+			std::lock_guard<std::mutex> lock(m_bidsMutex);
+			auto it=m_bids.find(results.roundId);
+			if(it==m_bids.end()){
+				fprintf(stderr, "Replay round %llu : no bid sent, recorded best=%lg\n", (unsigned long long)results.roundId, wide_as_double(BIGINT_WORDS, best.limbs));
+				return;
+			}
+			ours=it->second;
+			m_bids.erase(it);
+		}
+
+		bool beatBest=wide_compare(BIGINT_WORDS, ours.limbs, best.limbs)<0;
+		bool beatWinner=wide_compare(BIGINT_WORDS, ours.limbs, results.winner.proof)<0;
+		m_compared++;
+		m_beatBest+=beatBest;
+		m_beatWinner+=beatWinner;
+		fprintf(stderr, "Replay round %llu : ours=%lg, recorded best=%lg, recorded winner=%lg%s\n",
+			(unsigned long long)results.roundId, wide_as_double(BIGINT_WORDS, ours.limbs),
+			wide_as_double(BIGINT_WORDS, best.limbs), wide_as_double(BIGINT_WORDS, results.winner.proof),
+			beatBest ? ", beats everyone" : (beatWinner ? ", beats winner" : "")
+		);
+	}
+
+	void CheckShutdown()
+	{
+		std::lock_guard<std::mutex> lock(m_shutdownMutex);
+		if(m_shutdown)
+			throw std::runtime_error("ConnectionReplay::Recv - Connection has been shut down.");
+	}
+
+	//! Wait until the next record is due, and make it the current packet. Returns false if it was skipped.
+	bool DeliverNext()
+	{
+		if(m_next>=m_records.size())
+			throw std::runtime_error("ConnectionReplay::Recv - End of recording.");
+		CheckShutdown();
+		const record_t &r=m_records[m_next++];
+		const record_t &first=m_records[0];
+
+		if(m_next==1)
+			m_replayStart=now();
+		if(m_fast && r.command==Command_ServerBeginRound){
+			// Bring the rest of the recording forward to now
+			int64_t due=int64_t(r.timeRecv-first.timeRecv)-m_skipped;
+			int64_t elapsed=int64_t(now()-m_replayStart);
+			if(due>elapsed)
+				m_skipped+=due-elapsed;
+		}
+		int64_t shift=int64_t(m_replayStart-first.timeRecv)+m_skipped;
+
+		if(r.command==Command_ServerPong && m_fast)
+			return false;
+
+		timestamp_t tDue=r.timeRecv+shift;
+		{
+			std::unique_lock<std::mutex> lock(m_shutdownMutex);
+			timestamp_t tNow;
+			while(!m_shutdown && tDue>(tNow=now())){
+				m_shutdownCond.wait_for(lock, std::chrono::nanoseconds(tDue-tNow));
+			}
+		}
+		CheckShutdown();
+
+		m_currentPos=0;
+		m_current.assign(&m_data[r.offset], &m_data[r.offset]+r.length);
+		if(r.command!=Command_ServerRequestBid && r.command!=Command_ServerPong && r.command!=Command_ServerCompleteRound)
+			return true;
+
+		ConnectionOverMemory decoder;
+		decoder.SetRecvData(r.length, &m_data[r.offset]);
+		std::shared_ptr<Packet> packet=Packet::Recv(&decoder);
+		if(auto request=std::dynamic_pointer_cast<Packet_ServerRequestBid>(packet)){
+			request->timeStampRequestBids+=shift;
+			request->timeStampReceiveBids+=shift;
+			Encode(*request);
+		}else if(auto pong=std::dynamic_pointer_cast<Packet_ServerPong>(packet)){
+			pong->timeClientSent+=shift;
+			pong->timeServerRecv+=shift;
+			pong->timeServerSent+=shift;
+			Encode(*pong);
+		}else if(auto results=std::dynamic_pointer_cast<Packet_ServerCompleteRound>(packet)){
+			CompareResults(*results);
+			for(auto &sub : results->submissions){
+				sub.timeSent+=shift;
+				sub.timeRecv+=shift;
+			}
+			results->winner.timeSent+=shift;
+			results->winner.timeRecv+=shift;
+			Encode(*results);
+		}
+		return true;
+	}
+
+	//! Pick the final bids out of what the client sends
+	void ParseSent()
+	{
+		size_t begin=0;
+		while(m_sent.size()-begin >= 8){
+			uint64_t length=ReadBigEndian64(&m_sent[begin]);
+			if(length<20)
+				throw std::runtime_error("ConnectionReplay::Send - Sent packet length of < 20 bytes.");
+			if(m_sent.size()-begin < length)
+				break;
+
+			ConnectionOverMemory decoder;
+			decoder.SetRecvData(length, &m_sent[begin]);
+			std::shared_ptr<Packet> packet=Packet::Recv(&decoder);
+			begin+=length;
+
+			if(packet->CommandId()==Command_ClientSendBid){
+				auto bid=std::static_pointer_cast<Packet_ClientSendBid>(packet);
+				std::lock_guard<std::mutex> lock(m_bidsMutex);
+				wide_copy(BIGINT_WORDS, m_bids[bid->roundId].limbs, bid->proof);
+			}
+		}
+		m_sent.erase(m_sent.begin(), m_sent.begin()+begin);
+	}
+public:
+	ConnectionReplay(const std::string &path, bool fast)
+		: m_fast(fast)
+		, m_next(0)
+		, m_replayStart(0)
+		, m_skipped(0)
+		, m_currentPos(0)
+		, m_recvOffset(0)
+		, m_shutdown(false)
+		, m_sendOffset(0)
+		, m_compared(0)
+		, m_beatBest(0)
+		, m_beatWinner(0)
+	{
+		Load(path);
+		fprintf(stderr, "Replaying %u packets from '%s' (%s), covering %.1lf seconds.\n",
+			(unsigned)m_records.size(), path.c_str(), fast?"fast":"realtime",
+			(m_records.back().timeRecv-m_records.front().timeRecv)*1e-9
+		);
+	}
+
+	~ConnectionReplay()
+	{
+		if(m_compared>0){
+			fprintf(stderr, "Replay : compared %u rounds, ours was best in %u and beat the winner in %u.\n", m_compared, m_beatBest, m_beatWinner);
+		}
+	}
+
+	virtual void Send(size_t cbData, const void *pData) override
+	{
+		const uint8_t *pWrite=(const uint8_t*)pData;
+		m_sent.insert(m_sent.end(), pWrite, pWrite+cbData);
+		m_sendOffset+=cbData;
+		ParseSent();
+	}
+
+	virtual void Recv(size_t cbData, void *pData) override
+	{
+		uint8_t *pRead=(uint8_t*)pData;
+		while(cbData>0){
+			if(m_currentPos==m_current.size()){
+				// Waiting for the recorded time counts as being blocked in the transport
+				uint64_t t0=ConnectionStats::Clock();
+				while(!DeliverNext()){}
+				Stats().OnRecvCall(m_current.size(), ConnectionStats::Clock()-t0);
+			}
+			size_t todo=std::min(cbData, m_current.size()-m_currentPos);
+			memcpy(pRead, &m_current[m_currentPos], todo);
+			m_currentPos+=todo;
+			pRead+=todo;
+			cbData-=todo;
+			m_recvOffset+=todo;
+		}
+	}
+
+	virtual void Shutdown() override
+	{
+		std::lock_guard<std::mutex> lock(m_shutdownMutex);
+		m_shutdown=true;
+		m_shutdownCond.notify_all();
+	}
+
+	virtual uint64_t SendOffset() const override
+	{ return m_sendOffset; }
+
+	virtual uint64_t RecvOffset() const override
+	{ return m_recvOffset; }
+};
+
+}; // detail
+
+std::unique_ptr<Connection> OpenConnection_Record(std::vector<std::string> &spec)
+{
+	if(spec.size()<3 || spec[0]!="record")
+		throw std::invalid_argument("OpenConnection_Record - Spec should be 'record path connectionType [arg1 ...]'.");
+
+	std::vector<std::string> innerSpec(spec.begin()+2, spec.end());
+	std::unique_ptr<Connection> inner=OpenConnection(innerSpec);
+	fprintf(stderr, "Recording received packets to '%s'\n", spec[1].c_str());
+	return std::unique_ptr<Connection>(new detail::ConnectionRecord(inner, spec[1]));
+}
+
+std::unique_ptr<Connection> OpenConnection_Replay(std::vector<std::string> &spec)
+{
+	if(spec.size()<2 || spec.size()>3 || spec[0]!="replay")
+		throw std::invalid_argument("OpenConnection_Replay - Spec should be 'replay path [realtime|fast]'.");
+
+	bool fast=false;
+	if(spec.size()==3){
+		if(spec[2]=="fast"){
+			fast=true;
+		}else if(spec[2]!="realtime"){
+			throw std::invalid_argument("OpenConnection_Replay - Timing should be 'realtime' or 'fast'.");
+		}
+	}
+	return std::unique_ptr<Connection>(new detail::ConnectionReplay(spec[1], fast));
+}
+
+}; // bitecoin
+
+#endif
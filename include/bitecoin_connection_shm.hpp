@@ -0,0 +1,277 @@
+#ifndef bitecoin_connection_shm_hpp
+#define bitecoin_connection_shm_hpp
+
+#include "bitecoin_connection.hpp"
+#include "bitecoin_connection_buffered.hpp"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sstream>
+#include <atomic>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#endif
+
+namespace bitecoin{
+
+#if defined(__linux__)
+
+namespace detail{
+
+/*! One direction of a shared memory connection. There is exactly one producer and one
+	consumer, so the positions only need atomic loads and stores. Positions count bytes
+	since the start and are allowed to wrap, the ring size being a power of two. When one
+	side has to wait it sets its waiting flag and sleeps on the other side's position with
+	a futex, and the other side only makes the wake system call if the flag is set. */
+struct shm_ring_t
+{
+	enum{ SIZE = 1<<20 };
+
+	std::atomic<uint32_t> head;	// Bytes written so far, only changed by the producer
+	std::atomic<uint32_t> recvWaiting;	// Consumer is (about to be) asleep on head
+	uint8_t pad0[56];
+	std::atomic<uint32_t> tail;	// Bytes read so far, only changed by the consumer
+	std::atomic<uint32_t> sendWaiting;	// Producer is (about to be) asleep on tail
+	uint8_t pad1[56];
+	uint8_t data[SIZE];
+};
+
+struct shm_header_t
+{
+	enum{ MAGIC = 0x62736D31 };	// "bsm1"
+
+	std::atomic<uint32_t> magic;		// Set last by the server, once the rings are initialised
+	std::atomic<uint32_t> attached;	// Set by the client, the server waits on it like accept
+	std::atomic<uint32_t> closed;		// Set by either side when it goes away
+	uint8_t pad[52];
+	shm_ring_t rings[2];	// rings[0] is server to client, rings[1] is client to server
+};
+
+int futex_wait(std::atomic<uint32_t> *addr, uint32_t val, unsigned timeoutMs)
+{
+	struct timespec ts;
+	ts.tv_sec=timeoutMs/1000;
+	ts.tv_nsec=(timeoutMs%1000)*1000000;
+	return syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+void futex_wake(std::atomic<uint32_t> *addr)
+{
+	syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+class ConnectionOverShm
+	: public ConnectionBuffered
+{
+private:
+	friend std::unique_ptr<Connection> bitecoin::OpenConnection_Shm(std::vector<std::string> &spec);
+
+	// Sleeps are bounded so that we notice the other side closing
+	enum{ WAIT_TIMEOUT_MS = 100 };
+
+	shm_header_t *m_pShm;
+	shm_ring_t *m_pSend, *m_pRecv;
+
+	ConnectionOverShm(shm_header_t *pHeader, bool isServer)
+		: m_pShm(pHeader)
+		, m_pSend(&pHeader->rings[isServer?0:1])
+		, m_pRecv(&pHeader->rings[isServer?1:0])
+	{}
+
+	~ConnectionOverShm()
+	{
+		m_pShm->closed=1;
+		futex_wake(&m_pSend->head);
+		futex_wake(&m_pRecv->tail);
+		munmap(m_pShm, sizeof(shm_header_t));
+	}
+
+	// Either end closing or shutting down counts, and the other end sees it too
+	void CheckClosed(const char *where)
+	{
+		if(m_pShm->closed)
+			Throw<std::runtime_error>()<<where<<" - Other end of shared memory connection has closed.";
+	}
+
+	// Block until the other side has left some space, returning how much
+	uint32_t WaitSpace()
+	{
+		while(1){
+			uint32_t tail=m_pSend->tail.load(std::memory_order_acquire);
+			uint32_t space=shm_ring_t::SIZE-(m_pSend->head.load(std::memory_order_relaxed)-tail);
+			if(space)
+				return space;
+			CheckClosed("ConnectionOverShm::Send");
+			m_pSend->sendWaiting=1;
+			if(m_pSend->tail.load()==tail)	// Check again now the flag is visible
+				futex_wait(&m_pSend->tail, tail, WAIT_TIMEOUT_MS);
+			m_pSend->sendWaiting=0;
+		}
+	}
+
+	// Copy some bytes in at head without publishing them
+	void Put(uint32_t head, size_t cbData, const uint8_t *pData)
+	{
+		uint32_t pos=head&(shm_ring_t::SIZE-1);
+		size_t first=std::min<size_t>(cbData, shm_ring_t::SIZE-pos);
+		memcpy(m_pSend->data+pos, pData, first);
+		memcpy(m_pSend->data, pData+first, cbData-first);
+	}
+
+	void Publish(uint32_t head)
+	{
+		m_pSend->head.store(head);	// seq_cst, so it is ordered before reading the flag
+		if(m_pSend->recvWaiting.load())
+			futex_wake(&m_pSend->head);
+	}
+public:
+	//! The waits time out anyway, but this wakes anything waiting on either ring straight away
+	virtual void Shutdown() override
+	{
+		m_pShm->closed=1;
+		futex_wake(&m_pSend->head);
+		futex_wake(&m_pSend->tail);
+		futex_wake(&m_pRecv->head);
+		futex_wake(&m_pRecv->tail);
+	}
+
+protected:
+	virtual size_t RawSend(size_t cbData, const void *pData) override
+	{
+		uint32_t space=WaitSpace();
+		size_t todo=std::min<size_t>(space, cbData);
+		uint32_t head=m_pSend->head.load(std::memory_order_relaxed);
+		Put(head, todo, (const uint8_t*)pData);
+		Publish(head+todo);
+		return todo;
+	}
+
+	// Everything that fits goes in with a single wake
+	virtual size_t RawSendV(unsigned n, const struct iovec *parts) override
+	{
+		uint32_t space=WaitSpace();
+		uint32_t head=m_pSend->head.load(std::memory_order_relaxed);
+		size_t done=0;
+		for(unsigned i=0;i<n && done<space;i++){
+			size_t todo=std::min<size_t>(space-done, parts[i].iov_len);
+			Put(head+done, todo, (const uint8_t*)parts[i].iov_base);
+			done+=todo;
+		}
+		Publish(head+done);
+		return done;
+	}
+
+	virtual size_t RawRecv(size_t cbData, void *pData) override
+	{
+		uint32_t tail=m_pRecv->tail.load(std::memory_order_relaxed);
+		uint32_t avail;
+		while(1){
+			uint32_t head=m_pRecv->head.load(std::memory_order_acquire);
+			avail=head-tail;
+			if(avail)
+				break;
+			CheckClosed("ConnectionOverShm::Recv");
+			m_pRecv->recvWaiting=1;
+			if(m_pRecv->head.load()==head)
+				futex_wait(&m_pRecv->head, head, WAIT_TIMEOUT_MS);
+			m_pRecv->recvWaiting=0;
+		}
+
+		size_t todo=std::min<size_t>(avail, cbData);
+		uint32_t pos=tail&(shm_ring_t::SIZE-1);
+		size_t first=std::min<size_t>(todo, shm_ring_t::SIZE-pos);
+		memcpy(pData, m_pRecv->data+pos, first);
+		memcpy((uint8_t*)pData+first, m_pRecv->data, todo-first);
+
+		m_pRecv->tail.store(tail+todo);
+		if(m_pRecv->sendWaiting.load())
+			futex_wake(&m_pRecv->tail);
+		return todo;
+	}
+};
+
+}; // detail
+
+/*! Spec is 'shm server path' or 'shm client path'. The server creates (or truncates) the
+	file and waits for a client, the client waits for the file to be set up. Using a file
+	under /dev/shm keeps it out of the page cache writeback. */
+std::unique_ptr<Connection> OpenConnection_Shm(std::vector<std::string> &spec)
+{
+	if(spec.size()!=3 || spec[0]!="shm" || (spec[1]!="server" && spec[1]!="client"))
+		throw std::invalid_argument("OpenConnection_Shm - Spec should be 'shm server|client path'.");
+
+	bool isServer= spec[1]=="server";
+	const std::string &path=spec[2];
+	size_t size=sizeof(detail::shm_header_t);
+
+	int fd=-1;
+	if(isServer){
+		fprintf(stderr, "Creating shared memory connection at %s\n", path.c_str());
+		fd=open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+		if(fd==-1)
+			Throw<std::runtime_error>()<<"OpenConnection_Shm - Couldn't create '"<<path<<"', errno="<<errno;
+		if(ftruncate(fd, size)!=0){
+			int e=errno;
+			close(fd);
+			Throw<std::runtime_error>()<<"OpenConnection_Shm - Couldn't size '"<<path<<"', errno="<<e;
+		}
+	}else{
+		fprintf(stderr, "Will try to attach to shared memory connection at %s\n", path.c_str());
+		while(1){
+			fd=open(path.c_str(), O_RDWR);
+			struct stat st;
+			if(fd!=-1 && fstat(fd, &st)==0 && size_t(st.st_size)>=size)
+				break;
+			if(fd!=-1)
+				close(fd);
+			usleep(10000);
+		}
+	}
+
+	void *pMem=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	int e=errno;
+	close(fd);
+	if(pMem==MAP_FAILED)
+		Throw<std::runtime_error>()<<"OpenConnection_Shm - Couldn't map '"<<path<<"', errno="<<e;
+
+	detail::shm_header_t *pHeader=(detail::shm_header_t*)pMem;
+	if(isServer){
+		// The file was just truncated, so it is all zero already
+		pHeader->magic=detail::shm_header_t::MAGIC;
+		while(!pHeader->attached){
+			detail::futex_wait(&pHeader->attached, 0, 1000);
+		}
+	}else{
+		while(pHeader->magic!=detail::shm_header_t::MAGIC){
+			usleep(10000);
+		}
+		if(pHeader->attached || pHeader->closed){
+			munmap(pMem, size);
+			Throw<std::runtime_error>()<<"OpenConnection_Shm - '"<<path<<"' already has a client.";
+		}
+		pHeader->attached=1;
+		detail::futex_wake(&pHeader->attached);
+	}
+
+	// Roll on C++14
+	return std::unique_ptr<Connection>(new detail::ConnectionOverShm(pHeader, isServer));
+}
+
+#else
+
+std::unique_ptr<Connection> OpenConnection_Shm(std::vector<std::string> & /*spec*/)
+{
+	throw std::runtime_error("OpenConnection_Shm - Shared memory connections need Linux futexes.");
+}
+
+#endif
+
+}; // bitecoin
+
+#endif
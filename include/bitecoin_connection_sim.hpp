@@ -0,0 +1,365 @@
+#ifndef bitecoin_connection_sim_hpp
+#define bitecoin_connection_sim_hpp
+
+#include "bitecoin_protocol.hpp"
+
+#include <cmath>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <exception>
+#include <condition_variable>
+
+namespace bitecoin{
+
+namespace detail{
+
+//! Network conditions for ConnectionSim, applied the same way in both directions
+struct sim_params_t
+{
+	double delay;		// One way delay, in seconds
+	double jitter;		// Mean of the random extra delay on each packet, in seconds
+	double bandwidth;	// In bytes per second, or zero for no limit
+	double offset;		// How far the server's clock is ahead of ours, in seconds
+	unsigned seed;
+};
+
+/*! Sits between a client and its real connection to a server, and makes the network look
+	worse than it is. Every packet is held back by the one way delay plus an exponentially
+	distributed extra with mean jitter, and the link only carries so many bytes per second,
+	so big packets queue behind each other. Packets are never reordered, as with TCP.
+
+	The clock offset is simulated by moving the server's timestamps in what it sends (bid
+	requests, pongs and results), so it only makes sense on the client's side.
+
+	A thread reads from the real connection all the time, so arrival times are real, and
+	another writes to it when packets are due. The destructor lets the writer finish what
+	was already sent, then shuts the real connection down so the reader's Recv fails, and
+	joins both before the real connection is closed.
+
+	Unlike record, this keeps its own stats rather than the inner connection's, so time
+	spent waiting on the simulated link shows up as blocked.
+*/
+class ConnectionSim
+	: public Connection
+{
+private:
+	struct chunk_t
+	{
+		timestamp_t due;	// When it comes out of the simulated link
+		std::vector<uint8_t> data;
+	};
+
+	// One direction of the link
+	struct link_t
+	{
+		std::deque<chunk_t> queue;
+		timestamp_t busyUntil;	// When the last packet finished going onto the wire
+		timestamp_t lastDue;	// Nothing can arrive before what was sent ahead of it
+
+		link_t()
+			: busyUntil(0)
+			, lastDue(0)
+		{}
+	};
+
+	struct shared_t
+	{
+		std::unique_ptr<Connection> inner;
+		sim_params_t params;
+
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::mt19937 rng;
+		link_t up, down;	// Towards the server, and towards us
+		std::exception_ptr error;	// From either thread
+		bool quit;
+		bool shutdown;	// Recv fails from now on, even if there are packets waiting
+
+		//! When a packet of this size that enters the link now will come out. Must hold the mutex.
+		timestamp_t Schedule(link_t &link, size_t bytes)
+		{
+			timestamp_t t=now();
+			timestamp_t start=std::max(t, link.busyUntil);
+			if(params.bandwidth>0){
+				link.busyUntil=start+timestamp_t(1e9*bytes/params.bandwidth);
+			}else{
+				link.busyUntil=start;
+			}
+			double extra=params.delay;
+			if(params.jitter>0)
+				extra+=std::exponential_distribution<double>(1.0/params.jitter)(rng);
+			timestamp_t due=link.busyUntil+timestamp_t(extra*1e9);
+			due=std::max(due, link.lastDue);
+			link.lastDue=due;
+			return due;
+		}
+	};
+
+	std::shared_ptr<shared_t> m_shared;
+	std::thread m_writer, m_reader;
+
+	// Only touched by whichever thread is sending
+	std::vector<uint8_t> m_sendPacket;
+	uint64_t m_sendOffset;
+
+	// Only touched by whichever thread is receiving
+	chunk_t m_current;
+	size_t m_currentPos;
+	uint64_t m_recvOffset;
+
+	//! The server's clock is offset from ours, so move its timestamps
+	static void ApplyOffset(std::vector<uint8_t> &packet, int64_t offset)
+	{
+		uint32_t command=ntohl(*(const uint32_t*)&packet[8]);
+		if(command!=Command_ServerRequestBid && command!=Command_ServerPong && command!=Command_ServerCompleteRound)
+			return;
+
+		ConnectionOverMemory decoder;
+		decoder.SetRecvData(packet.size(), &packet[0]);
+		std::shared_ptr<Packet> p=Packet::Recv(&decoder);
+		if(auto request=std::dynamic_pointer_cast<Packet_ServerRequestBid>(p)){
+			request->timeStampRequestBids+=offset;
+			request->timeStampReceiveBids+=offset;
+		}else if(auto pong=std::dynamic_pointer_cast<Packet_ServerPong>(p)){
+			// timeClientSent is our own clock, echoed back
+			pong->timeServerRecv+=offset;
+			pong->timeServerSent+=offset;
+		}else if(auto results=std::dynamic_pointer_cast<Packet_ServerCompleteRound>(p)){
+			for(auto &sub : results->submissions){
+				sub.timeRecv+=offset;
+			}
+			results->winner.timeRecv+=offset;
+		}
+		ConnectionOverMemory encoder;
+		p->Send(&encoder);
+		packet=encoder.Sent();
+	}
+
+	static void Reader(std::shared_ptr<shared_t> shared)
+	{
+		int64_t offset=int64_t(shared->params.offset*1e9);
+		try{
+			while(1){
+				chunk_t chunk;
+				chunk.data.resize(8);
+				shared->inner->Recv(8, &chunk.data[0]);
+				uint64_t length=ReadBigEndian64(&chunk.data[0]);
+				if(length<20)
+					throw std::runtime_error("ConnectionSim - Received packet length of < 20 bytes.");
+				chunk.data.resize(length);
+				shared->inner->Recv(length-8, &chunk.data[8]);
+				if(offset!=0)
+					ApplyOffset(chunk.data, offset);
+
+				std::lock_guard<std::mutex> lock(shared->mutex);
+				if(shared->quit)
+					return;
+				chunk.due=shared->Schedule(shared->down, chunk.data.size());
+				shared->down.queue.push_back(std::move(chunk));
+				shared->cond.notify_all();
+			}
+		}catch(...){
+			std::lock_guard<std::mutex> lock(shared->mutex);
+			if(!shared->error)
+				shared->error=std::current_exception();
+			shared->cond.notify_all();
+		}
+	}
+
+	static void Writer(std::shared_ptr<shared_t> shared)
+	{
+		std::unique_lock<std::mutex> lock(shared->mutex);
+		try{
+			while(1){
+				if(shared->up.queue.empty()){
+					if(shared->quit)
+						return;
+					shared->cond.wait(lock);
+					continue;
+				}
+				timestamp_t due=shared->up.queue.front().due, t=now();
+				if(due>t){
+					shared->cond.wait_for(lock, std::chrono::nanoseconds(due-t));
+					continue;
+				}
+				chunk_t chunk=std::move(shared->up.queue.front());
+				shared->up.queue.pop_front();
+				lock.unlock();
+				shared->inner->Send(chunk.data.size(), &chunk.data[0]);
+				shared->inner->Flush();
+				lock.lock();
+			}
+		}catch(...){
+			if(!lock.owns_lock())
+				lock.lock();
+			if(!shared->error)
+				shared->error=std::current_exception();
+			shared->cond.notify_all();
+		}
+	}
+public:
+	ConnectionSim(std::unique_ptr<Connection> &inner, const sim_params_t &params)
+		: m_shared(std::make_shared<shared_t>())
+		, m_sendOffset(0)
+		, m_currentPos(0)
+		, m_recvOffset(0)
+	{
+		m_shared->inner=std::move(inner);
+		m_shared->params=params;
+		m_shared->rng.seed(params.seed);
+		m_shared->quit=false;
+		m_shared->shutdown=false;
+
+		std::shared_ptr<shared_t> shared=m_shared;
+		m_writer=std::thread([shared](){ Writer(shared); });
+		m_reader=std::thread([shared](){ Reader(shared); });
+	}
+
+	~ConnectionSim()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_shared->mutex);
+			m_shared->quit=true;
+			m_shared->cond.notify_all();
+		}
+		// Anything already sent still goes out
+		m_writer.join();
+		// The reader is probably blocked on the real connection
+		m_shared->inner->Shutdown();
+		m_reader.join();
+	}
+
+	virtual void Send(size_t cbData, const void *pData) override
+	{
+		const uint8_t *pWrite=(const uint8_t*)pData;
+		m_sendPacket.insert(m_sendPacket.end(), pWrite, pWrite+cbData);
+		m_sendOffset+=cbData;
+	}
+
+	//! Whatever has been sent goes into the link as one chunk
+	virtual void Flush() override
+	{
+		size_t bytes=m_sendPacket.size();
+		if(bytes==0)
+			return;
+		uint64_t t0=ConnectionStats::Clock();
+		{
+			std::lock_guard<std::mutex> lock(m_shared->mutex);
+			if(m_shared->error)
+				std::rethrow_exception(m_shared->error);
+			chunk_t chunk;
+			chunk.due=m_shared->Schedule(m_shared->up, bytes);
+			chunk.data.swap(m_sendPacket);
+			m_shared->up.queue.push_back(std::move(chunk));
+			m_shared->cond.notify_all();
+		}
+		Stats().OnSendCall(bytes, ConnectionStats::Clock()-t0);
+	}
+
+	virtual void Recv(size_t cbData, void *pData) override
+	{
+		uint8_t *pRead=(uint8_t*)pData;
+		while(cbData>0){
+			if(m_currentPos==m_current.data.size()){
+				// Waiting for the simulated network counts as blocked
+				uint64_t t0=ConnectionStats::Clock();
+				std::unique_lock<std::mutex> lock(m_shared->mutex);
+				while(1){
+					link_t &down=m_shared->down;
+					if(m_shared->shutdown){
+						throw std::runtime_error("ConnectionSim::Recv - Connection has been shut down.");
+					}else if(!down.queue.empty()){
+						timestamp_t due=down.queue.front().due, t=now();
+						if(due<=t)
+							break;
+						m_shared->cond.wait_for(lock, std::chrono::nanoseconds(due-t));
+					}else if(m_shared->error){
+						std::rethrow_exception(m_shared->error);
+					}else{
+						m_shared->cond.wait(lock);
+					}
+				}
+				m_current=std::move(m_shared->down.queue.front());
+				m_shared->down.queue.pop_front();
+				m_currentPos=0;
+				lock.unlock();
+				Stats().OnRecvCall(m_current.data.size(), ConnectionStats::Clock()-t0);
+			}
+			size_t todo=std::min(cbData, m_current.data.size()-m_currentPos);
+			memcpy(pRead, &m_current.data[m_currentPos], todo);
+			m_currentPos+=todo;
+			pRead+=todo;
+			cbData-=todo;
+			m_recvOffset+=todo;
+		}
+	}
+
+	virtual void Shutdown() override
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_shared->mutex);
+			m_shared->shutdown=true;
+			m_shared->cond.notify_all();
+		}
+		m_shared->inner->Shutdown();
+	}
+
+	virtual uint64_t SendOffset() const override
+	{ return m_sendOffset; }
+
+	virtual uint64_t RecvOffset() const override
+	{ return m_recvOffset; }
+};
+
+}; // detail
+
+std::unique_ptr<Connection> OpenConnection_Sim(std::vector<std::string> &spec)
+{
+	const char *usage="OpenConnection_Sim - Spec should be 'sim [delay=ms] [jitter=ms] [bandwidth=kbit/s] [offset=ms] [seed=n] connectionType [arg1 ...]'.";
+	if(spec.size()<2 || spec[0]!="sim")
+		throw std::invalid_argument(usage);
+
+	detail::sim_params_t params;
+	params.delay=0;
+	params.jitter=0;
+	params.bandwidth=0;
+	params.offset=0;
+	params.seed=time(0);
+
+	unsigned i=1;
+	for(;i<spec.size();i++){
+		size_t eq=spec[i].find('=');
+		if(eq==std::string::npos)
+			break;
+		std::string name=spec[i].substr(0, eq);
+		double value=strtod(spec[i].c_str()+eq+1, 0);
+		if(name=="delay"){
+			params.delay=value*1e-3;
+		}else if(name=="jitter"){
+			params.jitter=value*1e-3;
+		}else if(name=="bandwidth"){
+			params.bandwidth=value*1000/8;
+		}else if(name=="offset"){
+			params.offset=value*1e-3;
+		}else if(name=="seed"){
+			params.seed=unsigned(value);
+		}else{
+			throw std::invalid_argument(usage);
+		}
+	}
+	if(params.delay<0 || params.jitter<0 || params.bandwidth<0)
+		throw std::invalid_argument("OpenConnection_Sim - Delay, jitter and bandwidth can't be negative.");
+
+	std::vector<std::string> innerSpec(spec.begin()+i, spec.end());
+	std::unique_ptr<Connection> inner=OpenConnection(innerSpec);
+	fprintf(stderr, "Simulating delay=%lgms, jitter=%lgms, bandwidth=%lgkbit/s, offset=%lgms\n",
+		params.delay*1e3, params.jitter*1e3, params.bandwidth*8/1000, params.offset*1e3);
+	return std::unique_ptr<Connection>(new detail::ConnectionSim(inner, params));
+}
+
+}; // bitecoin
+
+#endif
@@ -2,6 +2,7 @@
 #define bitecoin_connection_socket_hpp
 
 #include "bitecoin_connection.hpp"
+#include "bitecoin_connection_buffered.hpp"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -14,6 +15,10 @@
 #include <ws2tcpip.h>
 #else
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/resource.h>
 #include <netdb.h>
 #include <unistd.h>
 #endif
@@ -25,18 +30,15 @@ namespace bitecoin{
 namespace detail{
 	
 class ConnectionOverSocket
-	: public Connection
+	: public ConnectionBuffered
 {
 private:	
 	friend std::unique_ptr<Connection> bitecoin::OpenConnection_Socket(std::vector<std::string> &spec);
 
 	int m_socket;
-	uint64_t m_sendOffset, m_recvOffset;
 
 	ConnectionOverSocket(int _socket)
 		: m_socket(_socket)
-		, m_sendOffset(0)
-		, m_recvOffset(0)
 	{
 		if(m_socket==-1)
 			throw std::invalid_argument("ConnectionOverSocket - Socket is invalid.");
@@ -55,55 +57,86 @@ public:
 	{
 		return std::unique_ptr<Connection>(new ConnectionOverSocket(_socket));
 	}
+	
+	//! recv returns 0 once the socket is shut down, and the other end sees EOF
+	virtual void Shutdown() override
+	{
+		shutdown(m_socket, 2);
+	}
 
-	virtual void Send(size_t cbData, const void *pData) override
+protected:
+	virtual size_t RawSend(size_t cbData, const void *pData) override
 	{
-		if(cbData > 0x7FFFFFFFUL)
-			throw std::logic_error("SendPacket - 64-bit packet lengths not tested.");
-		
-		const uint8_t *pWrite=(const uint8_t *)pData;
-		
-		uint64_t todo=cbData;
-		while(todo){
-			int done=send(m_socket, (char*)pWrite, todo, 0);
-			if(done<=0){
-				int e=errno;
-				std::stringstream acc;
-				acc<<"Send - Received error while reading writing to socket ("<<e<<" = "<<strerror(e)<<")";
-				throw std::runtime_error(acc.str());
-			}
-			m_sendOffset+=done;
-			pWrite += done;
-			todo -= done;
+		int done=send(m_socket, (const char*)pData, cbData, 0);
+		if(done<=0){
+			int e=errno;
+			std::stringstream acc;
+			acc<<"Send - Received error while reading writing to socket ("<<e<<" = "<<strerror(e)<<")";
+			throw std::runtime_error(acc.str());
 		}
+		return done;
 	}
 	
-	virtual void Recv(size_t cbData, void *pData) override
+#if !(defined(_WIN32) || defined(_WIN64))
+	virtual size_t RawSendV(unsigned n, const struct iovec *parts) override
 	{
-		uint8_t *pRead=(uint8_t*)pData;
-		
-		uint64_t todo=cbData;
-		while(todo){
-			int done=recv(m_socket, (char*)pRead, todo, 0);
-			if(done<=0){
-				int e=errno;
-				std::stringstream acc;
-				acc<<"Recv - Received error while reading reading from socket ("<<e<<" = "<<strerror(e)<<")";
-				throw std::runtime_error(acc.str());
-			}
-			m_recvOffset+=done;
-			pRead += done;
-			todo -= done;
+		ssize_t done=writev(m_socket, parts, n);
+		if(done<=0){
+			int e=errno;
+			std::stringstream acc;
+			acc<<"Send - Received error while reading writing to socket ("<<e<<" = "<<strerror(e)<<")";
+			throw std::runtime_error(acc.str());
 		}
+		return done;
 	}
+#endif
 	
-	virtual uint64_t SendOffset() const override
-	{ return m_sendOffset; }
-	
-	virtual uint64_t RecvOffset() const override
-	{ return m_recvOffset; }
+	virtual size_t RawRecv(size_t cbData, void *pData) override
+	{
+		int done=recv(m_socket, (char*)pData, cbData, 0);
+		if(done<=0){
+			int e=errno;
+			std::stringstream acc;
+			acc<<"Recv - Received error while reading reading from socket ("<<e<<" = "<<strerror(e)<<")";
+			throw std::runtime_error(acc.str());
+		}
+		return done;
+	}
 };
 
+/*! Each packet is already written in one go, so there is nothing for Nagle to coalesce,
+	and waiting for the previous packet's ACK before sending a bid just adds latency. */
+void SetNoDelay(int sock)
+{
+	int flag=1;
+	if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&flag, sizeof(flag))<0){
+		fprintf(stderr, "Couldn't set TCP_NODELAY, errno=%d\n", errno);
+	}
+}
+
+#if !(defined(_WIN32) || defined(_WIN64))
+//! Fill in a unix domain address, checking that the path fits
+void MakeUnixAddr(const std::string &path, struct sockaddr_un &addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	if(path.size()>=sizeof(addr.sun_path))
+		Throw<std::invalid_argument>()<<"OpenConnection_Socket - Unix socket path '"<<path<<"' is too long.";
+	strcpy(addr.sun_path, path.c_str());
+}
+
+//! Every client is a socket, so a thousand of them goes past the usual soft limit of 1024
+void RaiseFileLimit()
+{
+	struct rlimit lim;
+	if(getrlimit(RLIMIT_NOFILE, &lim)==0 && lim.rlim_cur<lim.rlim_max){
+		lim.rlim_cur=lim.rlim_max;
+		if(setrlimit(RLIMIT_NOFILE, &lim)!=0)
+			fprintf(stderr, "Couldn't raise open file limit, errno=%d\n", errno);
+	}
+}
+#endif
+
 }; // detail
 
 std::unique_ptr<Connection> OpenConnection_Socket(std::vector<std::string> &spec)
@@ -149,6 +182,7 @@ std::unique_ptr<Connection> OpenConnection_Socket(std::vector<std::string> &spec
 			close(sockListen);
 			Throw<std::runtime_error>() << "OpenConnection_Socket - Error on server accept, errno="<<e;
 		}	
+		detail::SetNoDelay(fd);
 
 		// Roll on C++14
 		return std::unique_ptr<Connection>(new detail::ConnectionOverSocket(fd));		
@@ -196,9 +230,78 @@ std::unique_ptr<Connection> OpenConnection_Socket(std::vector<std::string> &spec
 		if(curr==NULL){
 			Throw<std::runtime_error>()<<"OpenConnection_Socket - Couldn't connect, errno="<<e;
 		}
+		detail::SetNoDelay(sock);
 
 		// Roll on C++14
 		return std::unique_ptr<Connection>(new detail::ConnectionOverSocket(sock));		
+		
+#if !(defined(_WIN32) || defined(_WIN64))
+	}else if(spec[0]=="unix-server"){
+		if(spec.size()!=2)
+			throw std::invalid_argument("OpenConnection_Socket - Spec should be 'unix-server path'.");
+		
+		std::string path=spec[1];
+		fprintf(stderr, "Will listen for connection on unix socket %s\n", path.c_str());
+		
+		struct sockaddr_un server_addr;
+		detail::MakeUnixAddr(path, server_addr);
+		
+		int sockListen = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(sockListen==-1){
+			Throw<std::runtime_error>() << "OpenConnection_Socket - Couldn't create socket, errno="<<errno;
+		}
+		
+		// A previous server may have left its socket file behind
+		unlink(path.c_str());
+		
+		if(bind(sockListen, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0){
+			int e=errno;
+			close(sockListen);
+			Throw<std::runtime_error>() << "OpenConnection_Socket - Couldn't bind server socket, errno="<<e;
+		}
+		
+		if(listen(sockListen,1)<0){
+			int e=errno;
+			close(sockListen);
+			unlink(path.c_str());
+			Throw<std::runtime_error>() << "OpenConnection_Socket - Couldn't listen on server socket, errno="<<e;
+		}
+		
+		int fd = accept(sockListen, NULL, NULL);
+		int e=errno;
+		close(sockListen);
+		unlink(path.c_str());
+		if(fd<0){
+			Throw<std::runtime_error>() << "OpenConnection_Socket - Error on server accept, errno="<<e;
+		}
+		
+		// Roll on C++14
+		return std::unique_ptr<Connection>(new detail::ConnectionOverSocket(fd));
+		
+	}else if(spec[0]=="unix-client"){
+		if(spec.size()!=2)
+			throw std::invalid_argument("OpenConnection_Socket - Spec should be 'unix-client path'.");
+		
+		std::string path=spec[1];
+		fprintf(stderr, "Will try to connect to unix socket %s\n", path.c_str());
+		
+		struct sockaddr_un addr;
+		detail::MakeUnixAddr(path, addr);
+		
+		int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(sock==-1){
+			Throw<std::runtime_error>() << "OpenConnection_Socket - Couldn't create socket, errno="<<errno;
+		}
+		
+		if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+			int e=errno;
+			close(sock);
+			Throw<std::runtime_error>()<<"OpenConnection_Socket - Couldn't connect to '"<<path<<"', errno="<<e;
+		}
+		
+		// Roll on C++14
+		return std::unique_ptr<Connection>(new detail::ConnectionOverSocket(sock));
+#endif
 	}else{
 		Throw<std::runtime_error>() << "OpenConnection_Socket - Didn't understand spec header '"<<spec[0]<<"'.";
 		return 0;
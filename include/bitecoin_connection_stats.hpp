@@ -0,0 +1,240 @@
+#ifndef bitecoin_connection_stats_hpp
+#define bitecoin_connection_stats_hpp
+
+#include <cstdint>
+#include <cstring>
+
+#include <atomic>
+#include <chrono>
+
+namespace bitecoin{
+
+	//! Durations in power of two buckets. Bucket i holds [2^(i-1),2^i) ns, and the last one holds anything longer.
+	struct histogram_t
+	{
+		enum{ BUCKETS = 36 };	// The last bucket starts at about 17 seconds
+
+		uint64_t count;
+		uint64_t totalNs;
+		uint64_t buckets[BUCKETS];
+
+		static unsigned Bucket(uint64_t ns)
+		{
+			unsigned b=0;
+			while(ns && b<BUCKETS-1){
+				ns>>=1;
+				b++;
+			}
+			return b;
+		}
+
+		double MeanSeconds() const
+		{ return count ? totalNs*1e-9/count : 0; }
+
+		//! Upper edge of the bucket holding the p'th duration, so within a factor of two
+		double PercentileSeconds(double p) const
+		{
+			if(count==0)
+				return 0;
+			uint64_t want=uint64_t(p*count+0.5), acc=0;
+			for(unsigned i=0;i<BUCKETS;i++){
+				acc+=buckets[i];
+				if(acc>=want && acc>0)
+					return (uint64_t(1)<<i)*1e-9;
+			}
+			return (uint64_t(1)<<(BUCKETS-1))*1e-9;
+		}
+
+		void Subtract(const histogram_t &o)
+		{
+			count-=o.count;
+			totalNs-=o.totalNs;
+			for(unsigned i=0;i<BUCKETS;i++){
+				buckets[i]-=o.buckets[i];
+			}
+		}
+	};
+
+	//! Totals for one direction of one command id
+	struct packet_stats_t
+	{
+		uint64_t count;
+		uint64_t bytes;
+		histogram_t time;	// Encoding or decoding, not counting time spent blocked in the transport
+	};
+
+	/*! A snapshot of a connection's counters. Everything counts up from when the connection
+		was opened, so take the difference of two snapshots to look at an interval. */
+	struct connection_stats_t
+	{
+		enum{ MAX_COMMANDS = 16 };	// Packets with higher command ids are counted under 0
+
+		uint64_t sendCalls, recvCalls;		// Calls to the underlying transport
+		uint64_t bytesSent, bytesRecv;		// As moved by those calls
+		histogram_t sendBlocked, recvBlocked;	// Time spent inside them
+		packet_stats_t sent[MAX_COMMANDS], recv[MAX_COMMANDS];
+
+		void Subtract(const connection_stats_t &o)
+		{
+			sendCalls-=o.sendCalls;
+			recvCalls-=o.recvCalls;
+			bytesSent-=o.bytesSent;
+			bytesRecv-=o.bytesRecv;
+			sendBlocked.Subtract(o.sendBlocked);
+			recvBlocked.Subtract(o.recvBlocked);
+			for(unsigned i=0;i<MAX_COMMANDS;i++){
+				sent[i].count-=o.sent[i].count;
+				sent[i].bytes-=o.sent[i].bytes;
+				sent[i].time.Subtract(o.sent[i].time);
+				recv[i].count-=o.recv[i].count;
+				recv[i].bytes-=o.recv[i].bytes;
+				recv[i].time.Subtract(o.recv[i].time);
+			}
+		}
+	};
+
+	namespace detail{
+
+		// As histogram_t, but can be added to from several threads at once
+		class AtomicHistogram
+		{
+		private:
+			std::atomic<uint64_t> m_count;
+			std::atomic<uint64_t> m_totalNs;
+			std::atomic<uint64_t> m_buckets[histogram_t::BUCKETS];
+		public:
+			AtomicHistogram()
+				: m_count(0)
+				, m_totalNs(0)
+			{
+				for(auto &b : m_buckets){
+					b.store(0, std::memory_order_relaxed);
+				}
+			}
+
+			void Add(uint64_t ns)
+			{
+				m_buckets[histogram_t::Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+				m_totalNs.fetch_add(ns, std::memory_order_relaxed);
+				m_count.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			uint64_t TotalNs() const
+			{ return m_totalNs.load(std::memory_order_relaxed); }
+
+			void Read(histogram_t &h) const
+			{
+				h.count=m_count.load(std::memory_order_relaxed);
+				h.totalNs=m_totalNs.load(std::memory_order_relaxed);
+				for(unsigned i=0;i<histogram_t::BUCKETS;i++){
+					h.buckets[i]=m_buckets[i].load(std::memory_order_relaxed);
+				}
+			}
+		};
+
+		struct atomic_packet_stats_t
+		{
+			std::atomic<uint64_t> count;
+			std::atomic<uint64_t> bytes;
+			AtomicHistogram time;
+
+			atomic_packet_stats_t()
+				: count(0)
+				, bytes(0)
+			{}
+		};
+
+	}; // detail
+
+/*! Counters kept by every connection. Sending and receiving usually happen on different
+	threads, and someone else may be reading them, so everything is a relaxed atomic.
+	A snapshot taken while traffic is flowing may be a little inconsistent between fields.
+*/
+class ConnectionStats
+{
+private:
+	ConnectionStats(const ConnectionStats &); // = delete;
+	void operator=(const ConnectionStats &); // = delete;
+
+	std::atomic<uint64_t> m_sendCalls, m_recvCalls;
+	std::atomic<uint64_t> m_bytesSent, m_bytesRecv;
+	detail::AtomicHistogram m_sendBlocked, m_recvBlocked;
+	detail::atomic_packet_stats_t m_sent[connection_stats_t::MAX_COMMANDS], m_recv[connection_stats_t::MAX_COMMANDS];
+
+	static unsigned Slot(uint32_t command)
+	{ return command<connection_stats_t::MAX_COMMANDS ? command : 0; }
+public:
+	ConnectionStats()
+		: m_sendCalls(0)
+		, m_recvCalls(0)
+		, m_bytesSent(0)
+		, m_bytesRecv(0)
+	{}
+
+	//! Monotonic nanoseconds, only for measuring durations
+	static uint64_t Clock()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()
+		).count();
+	}
+
+	void OnSendCall(uint64_t bytes, uint64_t ns)
+	{
+		m_sendCalls.fetch_add(1, std::memory_order_relaxed);
+		m_bytesSent.fetch_add(bytes, std::memory_order_relaxed);
+		m_sendBlocked.Add(ns);
+	}
+
+	void OnRecvCall(uint64_t bytes, uint64_t ns)
+	{
+		m_recvCalls.fetch_add(1, std::memory_order_relaxed);
+		m_bytesRecv.fetch_add(bytes, std::memory_order_relaxed);
+		m_recvBlocked.Add(ns);
+	}
+
+	//! Total time blocked so far, so packet timings can leave it out
+	uint64_t SendBlockedNs() const
+	{ return m_sendBlocked.TotalNs(); }
+
+	uint64_t RecvBlockedNs() const
+	{ return m_recvBlocked.TotalNs(); }
+
+	void OnPacketSent(uint32_t command, uint64_t bytes, uint64_t ns)
+	{
+		auto &s=m_sent[Slot(command)];
+		s.count.fetch_add(1, std::memory_order_relaxed);
+		s.bytes.fetch_add(bytes, std::memory_order_relaxed);
+		s.time.Add(ns);
+	}
+
+	void OnPacketRecv(uint32_t command, uint64_t bytes, uint64_t ns)
+	{
+		auto &s=m_recv[Slot(command)];
+		s.count.fetch_add(1, std::memory_order_relaxed);
+		s.bytes.fetch_add(bytes, std::memory_order_relaxed);
+		s.time.Add(ns);
+	}
+
+	void Snapshot(connection_stats_t &res) const
+	{
+		res.sendCalls=m_sendCalls.load(std::memory_order_relaxed);
+		res.recvCalls=m_recvCalls.load(std::memory_order_relaxed);
+		res.bytesSent=m_bytesSent.load(std::memory_order_relaxed);
+		res.bytesRecv=m_bytesRecv.load(std::memory_order_relaxed);
+		m_sendBlocked.Read(res.sendBlocked);
+		m_recvBlocked.Read(res.recvBlocked);
+		for(unsigned i=0;i<connection_stats_t::MAX_COMMANDS;i++){
+			res.sent[i].count=m_sent[i].count.load(std::memory_order_relaxed);
+			res.sent[i].bytes=m_sent[i].bytes.load(std::memory_order_relaxed);
+			m_sent[i].time.Read(res.sent[i].time);
+			res.recv[i].count=m_recv[i].count.load(std::memory_order_relaxed);
+			res.recv[i].bytes=m_recv[i].bytes.load(std::memory_order_relaxed);
+			m_recv[i].time.Read(res.recv[i].time);
+		}
+	}
+};
+
+}; // bitecoin
+
+#endif
@@ -25,20 +25,42 @@ private:
 	void operator =(const Endpoint &); // = delete;
 
 	std::shared_ptr<ILog> m_log;
+	
+	// Only whichever thread is receiving uses this
+	PacketPool m_recvPool;
+	
+	// What the counters were at the last LogConnectionStats, and scratch for the new ones
+	connection_stats_t m_statsLast, m_statsNow;
+	
+	void LogHistogram(int level, const char *what, const char *name, uint64_t count, uint64_t bytes, const histogram_t &h)
+	{
+		Log(level, "  %4s %-21s : n=%llu, bytes=%llu, mean=%.1lfus, p50<%.1lfus, p99<%.1lfus", what, name,
+			(unsigned long long)count, (unsigned long long)bytes,
+			h.MeanSeconds()*1e6, h.PercentileSeconds(0.5)*1e6, h.PercentileSeconds(0.99)*1e6
+		);
+	}
 protected:
 	Endpoint(std::unique_ptr<Connection> &conn, std::shared_ptr<ILog> log)
 		: m_conn(std::move(conn))
 		, m_log(log)
-	{}
+	{
+		memset(&m_statsLast, 0, sizeof(m_statsLast));
+	}
 		
 	virtual void vLog(int level, const char *str, va_list args) override
 	{
 		m_log->vLog(level, str, args);
 	}
 	
+	//! Only call before anything is being received
+	void SetFlatCompleteRound(bool flat)
+	{
+		m_recvPool.SetFlatCompleteRound(flat);
+	}
+	
 	std::shared_ptr<Packet> RecvPacket(uint32_t commandId=0)
 	{
-		std::shared_ptr<Packet> packet=Packet::Recv(m_conn.get());
+		std::shared_ptr<Packet> packet=Packet::Recv(m_conn.get(), &m_recvPool);
 		if(commandId!=0){
 			if(commandId!=packet->CommandId())
 				throw std::runtime_error("Endpoint::RecvPacket - Expected packet of one type, but got something different.");
@@ -49,7 +71,7 @@ protected:
 	template<class T>
 	std::shared_ptr<T> RecvPacket()
 	{
-		std::shared_ptr<Packet> packet=Packet::Recv(m_conn.get());
+		std::shared_ptr<Packet> packet=Packet::Recv(m_conn.get(), &m_recvPool);
 		
 		std::shared_ptr<T> res=std::dynamic_pointer_cast<T>(packet);
 		if(!res)
@@ -61,6 +83,40 @@ protected:
 	{
 		packet->Send(m_conn.get());
 	}
+	
+	void SendPacket(const Packet &packet)
+	{
+		packet.Send(m_conn.get());
+	}
+	
+	//! Makes a RecvPacket blocked in another thread throw, so that thread can be joined
+	void ShutdownConnection()
+	{
+		m_conn->Shutdown();
+	}
+	
+	/*! Log what the connection has done since the last call, to see where the time goes.
+		Blocked is time inside the transport (kernel, and waiting for the other end), while
+		per packet times are just encoding or decoding. */
+	void LogConnectionStats(int level)
+	{
+		m_conn->Stats().Snapshot(m_statsNow);
+		connection_stats_t diff=m_statsNow;
+		diff.Subtract(m_statsLast);
+		m_statsLast=m_statsNow;
+		
+		Log(level, "Transport since last report:");
+		LogHistogram(level, "send", "(blocked)", diff.sendCalls, diff.bytesSent, diff.sendBlocked);
+		LogHistogram(level, "recv", "(blocked)", diff.recvCalls, diff.bytesRecv, diff.recvBlocked);
+		for(unsigned i=0;i<connection_stats_t::MAX_COMMANDS;i++){
+			if(diff.sent[i].count)
+				LogHistogram(level, "sent", CommandName(i), diff.sent[i].count, diff.sent[i].bytes, diff.sent[i].time);
+		}
+		for(unsigned i=0;i<connection_stats_t::MAX_COMMANDS;i++){
+			if(diff.recv[i].count)
+				LogHistogram(level, "recv", CommandName(i), diff.recv[i].count, diff.recv[i].bytes, diff.recv[i].time);
+		}
+	}
 public:
 };
 
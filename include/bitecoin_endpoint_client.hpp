@@ -11,10 +11,18 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <chrono>
+
+#include "tbb/concurrent_queue.h"
 
 #include "bitecoin_protocol.hpp"
 #include "bitecoin_endpoint.hpp"
 #include "bitecoin_hashing.hpp"
+#include "bitecoin_clock.hpp"
 
 namespace bitecoin{
 
@@ -29,6 +37,306 @@ private:
 
 	unsigned m_knownRounds;
 	std::map<std::string,unsigned> m_knownCoins;
+	
+	uint32_t m_serverProtocol;	// What the server said it supports when we connected
+	
+	/* Run is split over three threads. The network thread does nothing but read packets
+		from the server, the mining thread runs MakeBid, and the main thread reacts to what
+		they both post to m_events. The main thread also wakes up at the deadline, so the
+		bid goes out on time however long the miner takes to notice. Sends can come from
+		any thread, so they go through m_sendMutex.
+		
+		Once connected nothing here allocates per round: packets come from the endpoint's
+		pool, the threads live for the whole connection, and the outgoing bids are kept
+		as members so their solution vectors are reused. */
+	struct event_t
+	{
+		std::shared_ptr<Packet> packet;	// Packet from the server, or null
+		timestamp_t timeRecv;			// When it was read, used to timestamp pongs
+		bool minerDone;				// MakeBid has returned for round minerRoundId
+		uint64_t minerRoundId;
+		std::exception_ptr error;	// Something went wrong on one of the other threads
+	};
+	tbb::concurrent_queue<event_t> m_events;	// Reuses its pages once warmed up
+	std::mutex m_wakeMutex;	// Only used for sleeping, the queue itself is lock-free
+	std::condition_variable m_wake;
+	std::mutex m_sendMutex;
+	
+	// Pings sent at the start of each bid window
+	enum{ PING_BURST = 4 };
+	mutable std::mutex m_clockMutex;	// MakeBid asks for the margin while pongs are arriving
+	ClockEstimator m_clock;
+	uint32_t m_pingId;
+	
+	// The best bid we know about this round. OfferBid can be called from any thread
+	// while MakeBid is running, and nothing more is sent once the final bid is out.
+	std::mutex m_offerMutex;
+	uint64_t m_offerRoundId;
+	bigint_t m_offerProof;
+	std::vector<uint32_t> m_offerSolution;
+	unsigned m_offerCount;
+	bool m_finalSent;
+	Packet_ClientImproveBid m_improveBid;
+	Packet_ClientSendBid m_finalBid;
+	
+	// The mining thread waits here for each round, and says when it has finished with it
+	struct mine_job_t
+	{
+		std::shared_ptr<Packet_ServerBeginRound> beginRound;
+		std::shared_ptr<Packet_ServerRequestBid> requestBid;
+		double period;
+		double skewEstimate;
+	};
+	std::mutex m_mineMutex;
+	std::condition_variable m_mineCond;
+	mine_job_t m_mineJob;
+	bool m_mineHaveJob;
+	bool m_mineBusy;
+	bool m_mineQuit;
+	// Written by the mining thread, only looked at once it has posted minerDone
+	std::vector<uint32_t> m_minedSolution;
+	uint32_t m_minedProof[BIGINT_WORDS];
+	// Scratch for the default MakeBid
+	std::vector<uint32_t> m_trialIndices;
+	std::string m_scratchId;	// Only used by PrintResults
+	
+	void PostEvent(const event_t &ev)
+	{
+		m_events.push(ev);
+		std::lock_guard<std::mutex> lock(m_wakeMutex);
+		m_wake.notify_one();
+	}
+	
+	//! Wait for the next event until our clock reaches tWake. Returns false on timeout.
+	bool WaitEvent(event_t &ev, double tWake)
+	{
+		std::unique_lock<std::mutex> lock(m_wakeMutex);
+		while(!m_events.try_pop(ev)){
+			double tRemaining=tWake-now()*1e-9;
+			if(tRemaining<=0)
+				return false;
+			m_wake.wait_for(lock, std::chrono::duration<double>(std::min(tRemaining, 1.0)));
+		}
+		return true;
+	}
+	
+	void NetworkThread()
+	{
+		event_t ev;
+		ev.minerDone=false;
+		ev.minerRoundId=0;
+		try{
+			while(1){
+				ev.packet=RecvPacket();
+				ev.timeRecv=now();
+				PostEvent(ev);
+			}
+		}catch(...){
+			ev.packet.reset();
+			ev.error=std::current_exception();
+			PostEvent(ev);
+		}
+	}
+	
+	void MinerThread()
+	{
+		event_t done;
+		done.minerDone=true;
+		while(1){
+			mine_job_t job;
+			{
+				std::unique_lock<std::mutex> lock(m_mineMutex);
+				while(!m_mineHaveJob && !m_mineQuit){
+					m_mineCond.wait(lock);
+				}
+				if(m_mineQuit)
+					return;
+				job=m_mineJob;
+				m_mineJob=mine_job_t();
+				m_mineHaveJob=false;
+			}
+			
+			done.minerRoundId=job.beginRound->roundId;
+			done.error=std::exception_ptr();
+			try{
+				MakeBid(job.beginRound, job.requestBid, job.period, job.skewEstimate, m_minedSolution, m_minedProof);
+			}catch(...){
+				done.error=std::current_exception();
+			}
+			// Let the packets go back to the pool
+			job=mine_job_t();
+			
+			{
+				std::lock_guard<std::mutex> lock(m_mineMutex);
+				m_mineBusy=false;
+				m_mineCond.notify_all();
+			}
+			done.timeRecv=now();
+			PostEvent(done);
+		}
+	}
+	
+	//! Wait until the mining thread has finished with the last round
+	void WaitMinerIdle()
+	{
+		std::unique_lock<std::mutex> lock(m_mineMutex);
+		while(m_mineBusy){
+			m_mineCond.wait(lock);
+		}
+	}
+	
+	void StartMining(const mine_job_t &job)
+	{
+		std::lock_guard<std::mutex> lock(m_mineMutex);
+		m_mineJob=job;
+		m_mineHaveJob=true;
+		m_mineBusy=true;
+		m_mineCond.notify_all();
+	}
+	
+	void StopMiner(std::thread &miner)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mineMutex);
+			if(m_mineBusy)
+				Log(Log_Info, "Waiting for MakeBid to finish.");
+			m_mineQuit=true;
+			m_mineCond.notify_all();
+		}
+		miner.join();
+	}
+	
+	void SendFromAnyThread(const Packet &packet)
+	{
+		std::lock_guard<std::mutex> lock(m_sendMutex);
+		SendPacket(packet);
+	}
+	
+	/*! The server is waiting for bids at this point, so it answers straight away. The pongs
+		come back through the network thread, and the estimator remembers earlier rounds. */
+	void SendPings()
+	{
+		for(unsigned i=0;i<PING_BURST;i++){
+			Packet_ClientPing ping;
+			ping.pingId=++m_pingId;
+			ping.timeSent=now();
+			SendFromAnyThread(ping);
+		}
+	}
+	
+	/*! Send the final bid, using the given solution if it beats what has been offered.
+		Returns false if there is nothing to send yet, or it has already gone. */
+	bool SendFinalBid(const std::vector<uint32_t> *pSolution, const uint32_t *pProof)
+	{
+		std::lock_guard<std::mutex> lock(m_offerMutex);
+		if(m_finalSent)
+			return false;
+		if(pSolution && wide_compare(BIGINT_WORDS, pProof, m_offerProof.limbs)<0){
+			m_offerSolution=*pSolution;
+			wide_copy(BIGINT_WORDS, m_offerProof.limbs, pProof);
+		}
+		if(m_offerSolution.empty())
+			return false;
+		
+		m_finalBid.roundId=m_offerRoundId;
+		m_finalBid.solution=m_offerSolution;
+		wide_copy(BIGINT_WORDS, m_finalBid.proof, m_offerProof.limbs);
+		m_finalBid.timeSent=now();
+		SendFromAnyThread(m_finalBid);
+		m_finalSent=true;
+		return true;
+	}
+	
+	// The results arrive as a flat view, so the ids are copied here to be printed
+	void PrintResults(const Packet_ServerRequestBid *requestBid, const Packet_ServerCompleteRoundFlat *results)
+	{
+		std::string &id=m_scratchId;
+		uint32_t proof[BIGINT_WORDS];
+		for(unsigned i=0;i<results->SubmissionCount();i++){
+			auto sub=results->Submission(i);
+			id.assign(sub.ClientId(), sub.ClientIdLength());
+			sub.GetProof(proof);
+			timestamp_t timeRecv=sub.TimeRecv();
+			double taken=requestBid->timeStampReceiveBids*1e-9 - timeRecv*1e-9;
+			bool overDue=requestBid->timeStampReceiveBids < timeRecv;
+			Log(Log_Info, "  %16s : %.6lg, %lg%s", id.c_str(),
+					wide_as_double(BIGINT_WORDS, proof), taken,
+					overDue?" OVERDUE":""
+			);
+			if(m_knownCoins.find(id)==m_knownCoins.end()){
+				m_knownCoins[id]=0;
+			}
+		}
+		
+		auto winner=results->Winner();
+		id.assign(winner.ClientId(), winner.ClientIdLength());
+		if(id==m_clientId){
+			Log(Log_Info, "");
+			Log(Log_Info, "You won a coin!");
+			Log(Log_Info, "");
+		}
+		
+		m_knownRounds++;
+		m_knownCoins[id]++;
+		
+		Log(Log_Info, "  %16s : %6s, %8s\n", "ClientId", "Coins", "Success");
+		auto it=m_knownCoins.begin();
+		while(it!=m_knownCoins.end()){
+			Log(Log_Info, "  %16s : %6d, %.6lf", it->first.c_str(), it->second, it->second/(double)m_knownRounds);
+			++it;
+		}
+		
+		Log(Log_Verbose, "");
+	}
+protected:
+	//! True if the server will take improved bids before the final one
+	bool StreamingBids() const
+	{ return m_serverProtocol>=ProtocolVersion_StreamBids; }
+	
+	bool CanPing() const
+	{ return m_serverProtocol>=ProtocolVersion_Ping; }
+	
+	/*! How long before the server's deadline we should stop and send the bid. Once there are
+		ping measurements this is the one way delay, plus the usual variation in it, plus a
+		little for actually sending the bid. Until then it is the fallback. */
+	double DeadlineMargin(double fallback) const
+	{
+		std::lock_guard<std::mutex> lock(m_clockMutex);
+		if(!m_clock.Valid())
+			return fallback;
+		return m_clock.MinRtt()/2 + m_clock.RttJitter() + 0.005;
+	}
+	
+	/*! How long before the deadline mining stops and the final bid goes. The deadline timer in
+		Run uses this too, so it must agree with MakeBid or the last of the mining is thrown
+		away. If we can stream bids then whatever we have is already at the server, so there
+		is much less to lose. */
+	virtual double SafetyMargin() const
+	{ return DeadlineMargin(StreamingBids() ? 0.05 : 0.5); }
+	
+	/*! Called by MakeBid whenever it finds a better solution. It is remembered so that the
+		final bid can be sent at the deadline even if MakeBid is still going, and if the
+		server supports it, it is also sent straight away as an improved bid. Safe to call
+		from any thread, and offers that are no better than the last one are ignored. */
+	void OfferBid(unsigned nIndices, const uint32_t *pIndices, const uint32_t *pProof)
+	{
+		std::lock_guard<std::mutex> lock(m_offerMutex);
+		if(m_finalSent)
+			return;
+		if(wide_compare(BIGINT_WORDS, pProof, m_offerProof.limbs)>=0)
+			return;
+		wide_copy(BIGINT_WORDS, m_offerProof.limbs, pProof);
+		m_offerSolution.assign(pIndices, pIndices+nIndices);
+		
+		if(!StreamingBids())
+			return;
+		m_improveBid.roundId=m_offerRoundId;
+		m_improveBid.solution=m_offerSolution;
+		wide_copy(BIGINT_WORDS, m_improveBid.proof, pProof);
+		m_improveBid.timeSent=now();
+		SendFromAnyThread(m_improveBid);
+		m_offerCount++;
+	}
 public:
 	
 	EndpointClient(
@@ -41,7 +349,18 @@ public:
 		, m_minerId(minerId)
 		, m_clientId(clientId)
 		, m_knownRounds(0)
-	{}
+		, m_serverProtocol(ProtocolVersion_Basic)
+		, m_pingId(0)
+		, m_offerRoundId(0)
+		, m_offerCount(0)
+		, m_finalSent(false)
+		, m_mineHaveJob(false)
+		, m_mineBusy(false)
+		, m_mineQuit(false)
+	{
+		// Results can list every bid on a busy exchange, and we only glance at them
+		SetFlatCompleteRound(true);
+	}
 		
 	/* Here is a default implementation of make bid.
 		I would suggest that you override this method as a starting point.
@@ -54,7 +373,8 @@ public:
 		std::vector<uint32_t> &solution,												// Our vector of indices describing the solution
 		uint32_t *pProof																		// Will contain the "proof", which is just the value
 	){
-		double tSafetyMargin=0.5;	// accounts for uncertainty in network conditions
+		// accounts for uncertainty in network conditions
+		double tSafetyMargin= SafetyMargin();
 		/* This is when the server has said all bids must be produced by, plus the
 			adjustment for clock skew, and the safety margin
 		*/
@@ -65,7 +385,8 @@ public:
 		/*
 			We will use this to track the best solution we have created so far.
 		*/
-		std::vector<uint32_t> bestSolution(roundInfo->maxIndices);
+		std::vector<uint32_t> &bestSolution=solution;
+		bestSolution.resize(roundInfo->maxIndices);
 		bigint_t bestProof;
 		wide_ones(BIGINT_WORDS, bestProof.limbs);
 		
@@ -74,7 +395,8 @@ public:
 			++nTrials;
 			
 			Log(Log_Debug, "Trial %d.", nTrials);
-			std::vector<uint32_t> indices(roundInfo->maxIndices);
+			std::vector<uint32_t> &indices=m_trialIndices;
+			indices.resize(roundInfo->maxIndices);
 			uint32_t curr=0;
 			for(unsigned j=0;j<indices.size();j++){
 				curr=curr+1+(rand()%10);
@@ -90,6 +412,7 @@ public:
 				Log(Log_Verbose, "    Found new best, nTrials=%d, score=%lg, ratio=%lg.", nTrials, score, worst/score);
 				bestSolution=indices;
 				bestProof=proof;
+				OfferBid(indices.size(), &indices[0], proof.limbs);
 			}
 			
 			double t=now()*1e-9;	// Work out where we are against the deadline
@@ -100,7 +423,7 @@ public:
 				break;	// We have run out of time, send what we have
 		}
 		
-		solution=bestSolution;
+		// The best is already in solution
 		wide_copy(BIGINT_WORDS, pProof, bestProof.limbs);
 		
 		Log(Log_Verbose, "MakeBid - finish.");
@@ -108,6 +431,7 @@ public:
 		
 	void Run()
 	{
+		std::thread network, miner;
 		try{
 			auto beginConnect=std::make_shared<Packet_ClientBeginConnect>(m_clientId, m_minerId);
 			Log(Log_Info, "Connecting with clientId=%s, minerId=%s", m_clientId.begin(), m_minerId.begin());
@@ -115,69 +439,130 @@ public:
 			
 			auto endConnect=RecvPacket<Packet_ServerCompleteConnect>();
 			Log(Log_Info, "Connected to exchange=%s, running=%s", endConnect->exchangeId.c_str(), endConnect->serverId.c_str());
+			m_serverProtocol=endConnect->protocolVersion;
+			Log(Log_Verbose, "Server protocol version is %u, %s stream bids.", m_serverProtocol, StreamingBids()?"will":"won't");
+			
+			// From here on only the network thread reads from the connection
+			network=std::thread([this](){ NetworkThread(); });
+			miner=std::thread([this](){ MinerThread(); });
+			
+			std::shared_ptr<Packet_ServerBeginRound> beginRound;
+			std::shared_ptr<Packet_ServerRequestBid> requestBid;
+			double skewEstimate=0;
+			double tSend=HUGE_VAL;	// When the deadline timer goes off, on our clock
+			bool mining=false;
 			
+			Log(Log_Verbose, "Waiting for round to begin.");
 			while(1){
-				Log(Log_Verbose, "Waiting for round to begin.");
-				auto beginRound=RecvPacket<Packet_ServerBeginRound>();
-				Log(Log_Info, "Round beginning with %u bytes of chain data.", beginRound->chainData.size());
-				
-				Log(Log_Verbose, "Waiting for request for bid.");
-				auto requestBid=RecvPacket<Packet_ServerRequestBid>();
-				// Get an estimate of the skew between our clock and theirs. If it is positive,
-				// then we are ahead of them.
-				double tNow=now()*1e-9;
-				double skewEstimate=tNow - requestBid->timeStampRequestBids*1e-9;
-				// And work out how long they expect it to last, independent of the skew
-				double period=requestBid->timeStampReceiveBids*1e-9 - requestBid->timeStampRequestBids*1e-9;
-	
-				Log(Log_Info, "Received bid request: serverStart=%lf, ourStart=%lf, skew=%lg. Bid period=%lf", requestBid->timeStampRequestBids*1e-9,  tNow, skewEstimate, period);
-				
-				std::shared_ptr<Packet_ClientSendBid> bid=std::make_shared<Packet_ClientSendBid>();
-				
-				MakeBid(beginRound, requestBid, period, skewEstimate, bid->solution, bid->proof);
-				bid->timeSent=now();				
-				Log(Log_Verbose, "Bid ready.");
-				
-				SendPacket(bid);
-				Log(Log_Verbose, "Bid sent.");
-				
-				Log(Log_Verbose, "Waiting for results.");
-				auto results=RecvPacket<Packet_ServerCompleteRound>();
-				Log(Log_Info, "Got round results.");
-				
-				for(unsigned i=0;i<results->submissions.size();i++){
-					double taken=requestBid->timeStampReceiveBids*1e-9 - results->submissions[i].timeRecv*1e-9;
-					bool overDue=requestBid->timeStampReceiveBids < results->submissions[i].timeRecv;
-					Log(Log_Info, "  %16s : %.6lg, %lg%s", results->submissions[i].clientId.c_str(),
-							wide_as_double(BIGINT_WORDS, results->submissions[i].proof), taken,
-							overDue?" OVERDUE":""
-					);
-					if(m_knownCoins.find(results->submissions[i].clientId)==m_knownCoins.end()){
-						m_knownCoins[results->submissions[i].clientId]=0;
+				event_t ev;
+				if(!WaitEvent(ev, tSend)){
+					tSend=HUGE_VAL;
+					if(SendFinalBid(NULL, NULL)){
+						Log(Log_Verbose, "Bid sent on deadline timer, after %u improved bids.", m_offerCount);
+					}else{
+						Log(Log_Verbose, "Deadline timer went off with nothing to send, waiting for MakeBid.");
 					}
+					continue;
 				}
 				
-				if(results->winner.clientId==m_clientId){
-					Log(Log_Info, "");
-					Log(Log_Info, "You won a coin!");
-					Log(Log_Info, "");
-				}
-				
-				m_knownRounds++;
-				m_knownCoins[results->winner.clientId]++;
+				if(ev.error)
+					std::rethrow_exception(ev.error);
 				
-				Log(Log_Info, "  %16s : %6s, %8s\n", "ClientId", "Coins", "Success");
-				auto it=m_knownCoins.begin();
-				while(it!=m_knownCoins.end()){
-					Log(Log_Info, "  %16s : %6d, %.6lf", it->first.c_str(), it->second, it->second/(double)m_knownRounds);
-					++it;
+				if(ev.minerDone){
+					if(!mining || !beginRound || ev.minerRoundId!=beginRound->roundId)
+						continue;	// Already waited for when the next round started
+					mining=false;
+					tSend=HUGE_VAL;
+					if(SendFinalBid(&m_minedSolution, m_minedProof)){
+						Log(Log_Verbose, "Bid sent, after %u improved bids.", m_offerCount);
+					}
+					Log(Log_Verbose, "Waiting for results.");
+					continue;
 				}
 				
-				Log(Log_Verbose, "");
+				std::shared_ptr<Packet> packet=ev.packet;
+				if(auto pong=std::dynamic_pointer_cast<Packet_ServerPong>(packet)){
+					if(pong->pingId==0 || pong->pingId>m_pingId)
+						throw std::runtime_error("EndpointClient::Run - Pong does not match any ping.");
+					{
+						std::lock_guard<std::mutex> lock(m_clockMutex);
+						m_clock.AddSample(pong->timeClientSent, pong->timeServerRecv, pong->timeServerSent, ev.timeRecv);
+						skewEstimate=-m_clock.Offset();
+					}
+					// Sharpen the timer with the new estimate
+					if(tSend!=HUGE_VAL)
+						tSend=requestBid->timeStampReceiveBids*1e-9 + skewEstimate - SafetyMargin();
+					
+				}else if(auto begin=std::dynamic_pointer_cast<Packet_ServerBeginRound>(packet)){
+					beginRound=begin;
+					Log(Log_Info, "Round beginning with %u bytes of chain data.", beginRound->chainData.size());
+					Log(Log_Verbose, "Waiting for request for bid.");
+					
+				}else if(auto request=std::dynamic_pointer_cast<Packet_ServerRequestBid>(packet)){
+					if(!beginRound)
+						throw std::runtime_error("EndpointClient::Run - Request for bid before round began.");
+					requestBid=request;
+					
+					// The last round's miner should have stopped by now
+					WaitMinerIdle();
+					
+					// Get an estimate of the skew between our clock and theirs. If it is positive,
+					// then we are ahead of them. The one way estimate includes the network delay,
+					// so prefer what the pings have measured if there is anything.
+					double tNow=ev.timeRecv*1e-9;
+					double skewOneWay=tNow - requestBid->timeStampRequestBids*1e-9;
+					{
+						std::lock_guard<std::mutex> lock(m_clockMutex);
+						skewEstimate= m_clock.Valid() ? -m_clock.Offset() : skewOneWay;
+					}
+					if(CanPing())
+						SendPings();
+					// And work out how long they expect it to last, independent of the skew
+					double period=requestBid->timeStampReceiveBids*1e-9 - requestBid->timeStampRequestBids*1e-9;
+		
+					Log(Log_Info, "Received bid request: serverStart=%lf, ourStart=%lf, skew=%lg (one way %lg). Bid period=%lf", requestBid->timeStampRequestBids*1e-9,  tNow, skewEstimate, skewOneWay, period);
+					
+					{
+						std::lock_guard<std::mutex> lock(m_offerMutex);
+						m_offerRoundId=beginRound->roundId;
+						wide_ones(BIGINT_WORDS, m_offerProof.limbs);
+						m_offerSolution.clear();
+						m_offerCount=0;
+						m_finalSent=false;
+					}
+					tSend=requestBid->timeStampReceiveBids*1e-9 + skewEstimate - SafetyMargin();
+					
+					mining=true;
+					mine_job_t job;
+					job.beginRound=beginRound;
+					job.requestBid=requestBid;
+					job.period=period;
+					job.skewEstimate=skewEstimate;
+					StartMining(job);
+					
+				}else if(auto results=std::dynamic_pointer_cast<Packet_ServerCompleteRoundFlat>(packet)){
+					Log(Log_Info, "Got round results.");
+					if(requestBid)
+						PrintResults(requestBid.get(), results.get());
+					LogConnectionStats(Log_Verbose);
+					Log(Log_Verbose, "Waiting for round to begin.");
+					
+				}else{
+					Throw<std::runtime_error>()<<"EndpointClient::Run - Unexpected packet of type "<<typeid(*packet).name()<<".";
+				}
 			}
 
 		}catch(std::exception &e){
 			Log(Log_Fatal, "Exception : %s.", e.what());
+			// MakeBid can't be interrupted, but it will stop at the deadline
+			if(miner.joinable())
+				StopMiner(miner);
+			// It is probably blocked reading, and uses this endpoint, so make the read fail and
+			// wait for it rather than leave it running into whoever destroys us.
+			if(network.joinable()){
+				ShutdownConnection();
+				network.join();
+			}
 			throw;
 		}
 	}
@@ -0,0 +1,628 @@
+#ifndef  bitecoin_endpoint_exchange_hpp
+#define  bitecoin_endpoint_exchange_hpp
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include <vector>
+#include <memory>
+#include <map>
+#include <random>
+
+#include "bitecoin_protocol.hpp"
+#include "bitecoin_log.hpp"
+#include "bitecoin_hashing.hpp"
+#include "bitecoin_endpoint_server.hpp"
+#include "bitecoin_verifier.hpp"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace bitecoin{
+
+#if defined(__linux__)
+
+/*! A stand-in for the real exchange, which runs rounds for any number of clients at once.
+	All the sockets are non-blocking and driven from one epoll loop, so a slow client
+	can't hold up anyone else. Bytes are accumulated per client until a whole packet has
+	arrived, and only then decoded, and outgoing packets are encoded once and queued on
+	every client. Clients that connect part way through a round join at the next one.
+*/
+class EndpointExchange
+	: public ILog
+{
+private:
+	EndpointExchange(EndpointExchange &); // = delete;
+	void operator =(const EndpointExchange &); // = delete;
+
+	// How long after the deadline we keep waiting for stragglers
+	enum{ LATE_BID_GRACE_MS = 250 };
+	// Anything bigger than this is assumed to be garbage rather than a packet
+	enum{ MAX_PACKET_LENGTH = 1<<24 };
+	// Improved bids beyond this many per client in a round are ignored, so one chatty
+	// client can't bury the verifier and hold up the results for everyone
+	enum{ MAX_IMPROVED_BIDS = 16 };
+
+	struct client_t
+	{
+		int fd;
+		bool connected;	// Has completed the connect handshake
+		bool inRound;	// Was sent the current round, so is expecting to see the results
+		bool hasBid;	// Has sent its final bid
+		bool wantWrite;	// Currently registered for EPOLLOUT
+		std::string clientId, minerId;
+		std::vector<uint8_t> recvBuffer;
+		std::vector<uint8_t> sendBuffer;
+		size_t sendBegin;
+		int bestBid;	// Index of best bid this round in m_roundBids, or -1
+		unsigned improvedBids;	// Improved bids submitted this round
+		uint32_t claimedProof[BIGINT_WORDS];	// Lowest proof claimed by a submitted bid this round, not yet checked
+	};
+
+	struct round_bid_t
+	{
+		std::shared_ptr<client_t> client;
+		submission_t bid;
+	};
+
+	std::shared_ptr<ILog> m_log;
+	std::string m_exchangeId, m_serverId;
+	int m_listen, m_epoll;
+	std::map<int,std::shared_ptr<client_t> > m_clients;
+
+	uint64_t m_roundId;
+	std::shared_ptr<RoundSchedule> m_schedule;
+	std::mt19937 m_rng;
+
+	// Bids are checked in the background as they arrive. The key for each
+	// one is its position in m_roundBids.
+	SubmissionVerifier m_verifier;
+	std::vector<round_bid_t> m_roundBids;
+
+	// Scratch for encoding and decoding
+	detail::ConnectionOverMemory m_encoder;
+	PacketPool m_recvPool;
+	std::vector<uint8_t> m_readChunk;
+
+	void SetNonBlocking(int fd)
+	{
+		int flags=fcntl(fd, F_GETFL, 0);
+		if(flags==-1 || fcntl(fd, F_SETFL, flags|O_NONBLOCK)==-1)
+			Throw<std::runtime_error>()<<"EndpointExchange - Couldn't make socket non-blocking, errno="<<errno;
+	}
+
+	void Watch(int fd, uint32_t events, int op)
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events=events;
+		ev.data.fd=fd;
+		if(epoll_ctl(m_epoll, op, fd, &ev)!=0)
+			Throw<std::runtime_error>()<<"EndpointExchange - epoll_ctl failed, errno="<<errno;
+	}
+
+	//! Spec is either 'tcp-server port' or 'unix-server path'
+	int OpenListener(const std::vector<std::string> &spec)
+	{
+		int sock=-1;
+		if(spec.size()==2 && spec[0]=="tcp-server"){
+			int portNum=atoi(spec[1].c_str());
+			Log(Log_Info, "Will listen for connections on port %d", portNum);
+
+			sock=socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			if(sock==-1)
+				Throw<std::runtime_error>()<<"EndpointExchange - Couldn't create socket, errno="<<errno;
+
+			// Let the exchange restart straight away on the same port
+			int flag=1;
+			setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+			struct sockaddr_in addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family=AF_INET;
+			addr.sin_port=htons(portNum);
+			addr.sin_addr.s_addr=INADDR_ANY;
+			if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+				int e=errno;
+				close(sock);
+				Throw<std::runtime_error>()<<"EndpointExchange - Couldn't bind server socket, errno="<<e;
+			}
+		}else if(spec.size()==2 && spec[0]=="unix-server"){
+			Log(Log_Info, "Will listen for connections on unix socket %s", spec[1].c_str());
+
+			struct sockaddr_un addr;
+			detail::MakeUnixAddr(spec[1], addr);
+
+			sock=socket(AF_UNIX, SOCK_STREAM, 0);
+			if(sock==-1)
+				Throw<std::runtime_error>()<<"EndpointExchange - Couldn't create socket, errno="<<errno;
+
+			unlink(spec[1].c_str());
+			if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+				int e=errno;
+				close(sock);
+				Throw<std::runtime_error>()<<"EndpointExchange - Couldn't bind server socket, errno="<<e;
+			}
+		}else{
+			throw std::invalid_argument("EndpointExchange - Spec should be 'tcp-server port' or 'unix-server path'.");
+		}
+
+		if(listen(sock, SOMAXCONN)<0){
+			int e=errno;
+			close(sock);
+			Throw<std::runtime_error>()<<"EndpointExchange - Couldn't listen on server socket, errno="<<e;
+		}
+		SetNonBlocking(sock);
+		return sock;
+	}
+
+	void AcceptAll()
+	{
+		while(1){
+			int fd=accept(m_listen, NULL, NULL);
+			if(fd<0){
+				if(errno==EAGAIN || errno==EWOULDBLOCK)
+					return;
+				if(errno==EINTR || errno==ECONNABORTED)
+					continue;
+				Log(Log_Error, "Error on accept, errno=%d", errno);
+				return;
+			}
+			SetNonBlocking(fd);
+			// Fails harmlessly on unix sockets
+			int flag=1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+			auto client=std::make_shared<client_t>();
+			client->fd=fd;
+			client->connected=false;
+			client->inRound=false;
+			client->hasBid=false;
+			client->wantWrite=false;
+			client->sendBegin=0;
+			client->bestBid=-1;
+			client->improvedBids=0;
+			wide_ones(BIGINT_WORDS, client->claimedProof);
+			m_clients[fd]=client;
+			Watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+			Log(Log_Verbose, "Accepted connection, fd=%d, now have %u sockets.", fd, (unsigned)m_clients.size());
+		}
+	}
+
+	void Drop(const std::shared_ptr<client_t> &client, const char *reason)
+	{
+		Log(Log_Info, "Dropping client %s (fd=%d) : %s", client->clientId.c_str(), client->fd, reason);
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, client->fd, NULL);
+		close(client->fd);
+		m_clients.erase(client->fd);
+	}
+
+	//! Write as much of the queue as the socket will take, and ask for EPOLLOUT if some is left
+	void WriteClient(client_t &client)
+	{
+		while(client.sendBegin < client.sendBuffer.size()){
+			ssize_t done=send(client.fd, &client.sendBuffer[client.sendBegin], client.sendBuffer.size()-client.sendBegin, MSG_NOSIGNAL);
+			if(done<0){
+				if(errno==EAGAIN || errno==EWOULDBLOCK)
+					break;
+				if(errno==EINTR)
+					continue;
+				Throw<std::runtime_error>()<<"send failed, errno="<<errno;
+			}
+			client.sendBegin+=done;
+		}
+
+		bool pending=client.sendBegin < client.sendBuffer.size();
+		if(!pending){
+			client.sendBuffer.clear();
+			client.sendBegin=0;
+		}
+		if(pending!=client.wantWrite){
+			Watch(client.fd, pending ? (EPOLLIN|EPOLLOUT) : EPOLLIN, EPOLL_CTL_MOD);
+			client.wantWrite=pending;
+		}
+	}
+
+	void Queue(client_t &client, const std::vector<uint8_t> &bytes)
+	{
+		client.sendBuffer.insert(client.sendBuffer.end(), bytes.begin(), bytes.end());
+		if(!client.wantWrite)
+			WriteClient(client);
+	}
+
+	const std::vector<uint8_t> &Encode(const Packet &packet)
+	{
+		m_encoder.ClearSent();
+		packet.Send(&m_encoder);
+		return m_encoder.Sent();
+	}
+
+	void SendError(const std::shared_ptr<client_t> &client, const std::string &msg)
+	{
+		Packet_ServerError err;
+		err.errorMessage=msg;
+		try{
+			Queue(*client, Encode(err));
+		}catch(std::exception &){
+			// It is going anyway
+		}
+		Drop(client, msg.c_str());
+	}
+
+	//! Send to everyone that is connected, or only those in the current round
+	void Broadcast(const Packet &packet, bool onlyInRound)
+	{
+		const std::vector<uint8_t> &bytes=Encode(packet);
+
+		std::vector<std::shared_ptr<client_t> > failed;
+		for(auto &kv : m_clients){
+			client_t &client=*kv.second;
+			if(!client.connected || (onlyInRound && !client.inRound))
+				continue;
+			try{
+				Queue(client, bytes);
+			}catch(std::exception &){
+				failed.push_back(kv.second);
+			}
+		}
+		for(auto &client : failed){
+			Drop(client, "error while sending");
+		}
+	}
+
+	void HandlePacket(const std::shared_ptr<client_t> &client, const std::shared_ptr<Packet> &packet, timestamp_t timeRecv)
+	{
+		if(auto connect=std::dynamic_pointer_cast<Packet_ClientBeginConnect>(packet)){
+			if(client->connected)
+				throw std::runtime_error("Client tried to connect twice.");
+			client->clientId=connect->clientId;
+			client->minerId=connect->minerId;
+			client->connected=true;
+			Log(Log_Info, "Received connection from clientId=%s, minerId=%s", client->clientId.c_str(), client->minerId.c_str());
+
+			Packet_ServerCompleteConnect complete(m_exchangeId, m_serverId);
+			complete.protocolVersion=ProtocolVersion_Ping;
+			Queue(*client, Encode(complete));
+
+		}else if(auto ping=std::dynamic_pointer_cast<Packet_ClientPing>(packet)){
+			// Answered at any time, not just during the bid window
+			Packet_ServerPong pong;
+			pong.pingId=ping->pingId;
+			pong.timeClientSent=ping->timeSent;
+			pong.timeServerRecv=timeRecv;
+			pong.timeServerSent=now();
+			Queue(*client, Encode(pong));
+			
+		}else if(auto bid=std::dynamic_pointer_cast<Packet_ClientSendBid>(packet)){
+			if(!client->connected)
+				throw std::runtime_error("Client sent bid before connecting.");
+			// Older clients leave roundId as zero, so only a non-zero mismatch is stale
+			if(!client->inRound || (bid->roundId!=0 && bid->roundId!=m_roundId)){
+				Log(Log_Info, "Ignoring bid from %s for round %llu, current round is %llu.", client->clientId.c_str(), (unsigned long long)bid->roundId, (unsigned long long)m_roundId);
+				return;
+			}
+			if(client->hasBid)
+				throw std::runtime_error("Client sent another bid after its final one.");
+			
+			// Improved bids are checked just like final ones, which one to keep is decided at the end.
+			// A bid that claims no better than one already submitted couldn't be kept, so it
+			// isn't checked at all.
+			bool isFinal= bid->CommandId()==Command_ClientSendBid;
+			client->hasBid=isFinal;
+			if(!isFinal && client->improvedBids>=MAX_IMPROVED_BIDS){
+				Log(Log_Debug, "Ignoring improved bid from %s, it has already sent %u this round.", client->clientId.c_str(), client->improvedBids);
+				return;
+			}
+			if(wide_compare(BIGINT_WORDS, bid->proof, client->claimedProof)>=0){
+				Log(Log_Debug, "Ignoring %s bid from %s, it is no better than one already sent.", isFinal?"final":"improved", client->clientId.c_str());
+				return;
+			}
+			wide_copy(BIGINT_WORDS, client->claimedProof, bid->proof);
+			if(!isFinal)
+				client->improvedBids++;
+
+			round_bid_t rb;
+			rb.client=client;
+			rb.bid.clientId=client->clientId;
+			rb.bid.solution.swap(bid->solution);
+			memcpy(rb.bid.proof, bid->proof, BIGINT_LENGTH);
+			rb.bid.timeSent=bid->timeSent;
+			rb.bid.timeRecv=timeRecv;
+			Log(Log_Verbose, "Received %s bid from %s.", isFinal?"final":"improved", client->clientId.c_str());
+			
+			m_verifier.Submit(m_roundBids.size(), rb.bid);
+			m_roundBids.push_back(rb);
+		}else{
+			Throw<std::runtime_error>()<<"Unexpected packet with command "<<packet->CommandId();
+		}
+	}
+
+	//! Decode every complete packet at the front of the receive buffer
+	void ParsePackets(const std::shared_ptr<client_t> &client, timestamp_t timeRecv)
+	{
+		std::vector<uint8_t> &buffer=client->recvBuffer;
+		size_t begin=0;
+		while(buffer.size()-begin >= 8){
+			const uint32_t *pWords=(const uint32_t*)&buffer[begin];
+			uint64_t length=(uint64_t(ntohl(pWords[0]))<<32) | ntohl(pWords[1]);
+			if(length<20 || length>MAX_PACKET_LENGTH)
+				Throw<std::runtime_error>()<<"Received packet with bad length "<<length;
+			if(buffer.size()-begin < length)
+				break;
+
+			detail::ConnectionOverMemory decoder;
+			decoder.SetRecvData(length, &buffer[begin]);
+			auto packet=Packet::Recv(&decoder, &m_recvPool);
+			begin+=length;
+
+			HandlePacket(client, packet, timeRecv);
+		}
+		buffer.erase(buffer.begin(), buffer.begin()+begin);
+	}
+
+	void ReadClient(const std::shared_ptr<client_t> &client)
+	{
+		while(1){
+			ssize_t done=recv(client->fd, &m_readChunk[0], m_readChunk.size(), 0);
+			if(done==0)
+				throw std::runtime_error("Client closed connection.");
+			if(done<0){
+				if(errno==EAGAIN || errno==EWOULDBLOCK)
+					return;
+				if(errno==EINTR)
+					continue;
+				Throw<std::runtime_error>()<<"recv failed, errno="<<errno;
+			}
+			// Stamp as soon as the bytes are here, rather than when we get round to checking them
+			timestamp_t timeRecv=now();
+			client->recvBuffer.insert(client->recvBuffer.end(), &m_readChunk[0], &m_readChunk[done]);
+			ParsePackets(client, timeRecv);
+		}
+	}
+
+	//! Process whatever events turn up within timeoutMs (or block if it is negative)
+	void Poll(int timeoutMs)
+	{
+		struct epoll_event events[64];
+		int n=epoll_wait(m_epoll, events, 64, timeoutMs);
+		if(n<0){
+			if(errno==EINTR)
+				return;
+			Throw<std::runtime_error>()<<"EndpointExchange - epoll_wait failed, errno="<<errno;
+		}
+
+		for(int i=0;i<n;i++){
+			int fd=events[i].data.fd;
+			if(fd==m_listen){
+				AcceptAll();
+				continue;
+			}
+
+			// May have been dropped while handling an earlier event
+			auto it=m_clients.find(fd);
+			if(it==m_clients.end())
+				continue;
+			std::shared_ptr<client_t> client=it->second;
+
+			try{
+				if(events[i].events & EPOLLOUT)
+					WriteClient(*client);
+				if(events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+					ReadClient(client);
+			}catch(std::exception &e){
+				SendError(client, e.what());
+			}
+		}
+	}
+
+	unsigned CountConnected() const
+	{
+		unsigned acc=0;
+		for(auto &kv : m_clients){
+			acc += kv.second->connected ? 1 : 0;
+		}
+		return acc;
+	}
+
+	bool AllBidsIn() const
+	{
+		for(auto &kv : m_clients){
+			if(kv.second->inRound && !kv.second->hasBid)
+				return false;
+		}
+		return true;
+	}
+
+	void RunRound()
+	{
+		auto beginRound=m_schedule->MakeBeginRound(m_roundId);
+		m_verifier.BeginRound(beginRound.get());
+		m_roundBids.clear();
+
+		for(auto &kv : m_clients){
+			kv.second->inRound=kv.second->connected;
+			kv.second->hasBid=false;
+			kv.second->bestBid=-1;
+			kv.second->improvedBids=0;
+			wide_ones(BIGINT_WORDS, kv.second->claimedProof);
+		}
+		unsigned nInRound=CountConnected();
+		Log(Log_Info, "Starting round %llu with %u clients.", (unsigned long long)m_roundId, nInRound);
+
+		Broadcast(*beginRound, true);
+
+		double roundLength=m_schedule->MakeRoundLength();
+		timestamp_t start=now();
+		timestamp_t finish=uint64_t(start+roundLength*1e9);
+
+		Packet_ServerRequestBid requestBid;
+		requestBid.timeStampRequestBids=start;
+		requestBid.timeStampReceiveBids=finish;
+		Broadcast(requestBid, true);
+		Log(Log_Verbose, "Requested bids, period=%lf.", roundLength);
+
+		timestamp_t giveUp=finish+uint64_t(LATE_BID_GRACE_MS)*1000000;
+		while(!AllBidsIn()){
+			timestamp_t t=now();
+			if(t>=giveUp)
+				break;
+			Poll(int((giveUp-t)/1000000)+1);
+		}
+
+		timestamp_t tClosed=now();
+		std::vector<verify_result_t> results=m_verifier.Finish();
+		double tVerifyTail=(now()-tClosed)*1e-9;
+
+		// Pick out the best valid bid from each client, any invalid one gets them thrown out
+		std::vector<double> latencies;
+		unsigned nRejected=0;
+		for(const auto &res : results){
+			const round_bid_t &rb=m_roundBids[res.key];
+			std::shared_ptr<client_t> client=rb.client;
+			latencies.push_back(res.Latency());
+			
+			// Skip anyone who went away while their bid was being checked
+			auto it=m_clients.find(client->fd);
+			if(it==m_clients.end() || it->second!=client)
+				continue;
+			
+			if(!res.valid){
+				nRejected++;
+				Log(Log_Error, "CheckSubmission for submission from %s, %s", client->clientId.c_str(), res.error.c_str());
+				SendError(client, "CheckSubmission - "+res.error);
+				continue;
+			}
+			if(client->bestBid<0 || IsBetterBid(rb.bid, m_roundBids[client->bestBid].bid, finish))
+				client->bestBid=res.key;
+		}
+		
+		std::vector<submission_t> submissions;
+		std::vector<bigint_t> proofs;
+		unsigned nBids=0, nLate=0;
+		for(auto &kv : m_clients){
+			client_t &client=*kv.second;
+			if(!client.inRound || client.bestBid<0)
+				continue;
+			const submission_t &bid=m_roundBids[client.bestBid].bid;
+			nBids++;
+			if(bid.timeRecv > finish)
+				nLate++;
+			submissions.push_back(bid);
+			bigint_t proof;
+			wide_copy(BIGINT_WORDS, proof.limbs, bid.proof);
+			proofs.push_back(proof);
+		}
+		unsigned nPackets=m_roundBids.size();
+		m_roundBids.clear();
+
+		Packet_ServerCompleteRound summary;
+		summary.roundId=m_roundId;
+		timestamp_t tChoose=now();
+		if(proofs.size()>0){
+			summary.winner=submissions[ChooseWinner(proofs, m_rng)];
+		}else{
+			summary.winner.timeSent=0;
+			summary.winner.timeRecv=0;
+			memset(summary.winner.proof, 0xFF, BIGINT_LENGTH);
+		}
+		timestamp_t tBroadcast=now();
+		summary.submissions.swap(submissions);
+		Broadcast(summary, true);
+		double tChooseWinner=(tBroadcast-tChoose)*1e-9, tBroadcastDone=(now()-tBroadcast)*1e-9;
+		// Everyone gets everyone's submission, so this grows as the square of the clients
+		size_t cbResults=m_encoder.Sent().size();
+
+		Log(Log_Info, "Round %llu complete, clients=%u, bids=%u (from %u packets), late=%u, rejected=%u, winner=%s.",
+			(unsigned long long)m_roundId, nInRound, nBids, nPackets, nLate, nRejected, summary.winner.clientId.c_str()
+		);
+		latency_summary_t lat=SummariseLatency(latencies);
+		Log(Log_Info, "  Verify latency (ms) : n=%u, p50=%.3lf, p90=%.3lf, p99=%.3lf, max=%.3lf, after close=%.3lf",
+			lat.n, lat.p50*1e3, lat.p90*1e3, lat.p99*1e3, lat.max*1e3, tVerifyTail*1e3
+		);
+		Log(Log_Verbose, "  Close (ms) : choose winner=%.3lf, encode and queue results=%.3lf, results are %.1lf KB each",
+			tChooseWinner*1e3, tBroadcastDone*1e3, cbResults/1024.0
+		);
+		m_roundId++;
+	}
+protected:
+	virtual void vLog(int level, const char *str, va_list args) override
+	{
+		m_log->vLog(level, str, args);
+	}
+public:
+	EndpointExchange(
+			std::string exchangeId,
+			std::string serverId,
+			const std::vector<std::string> &spec,
+			int logLevel=1,
+			std::shared_ptr<RoundSchedule> schedule=std::shared_ptr<RoundSchedule>()
+		)
+		: ILog(logLevel)
+		, m_log(std::make_shared<LogDest>(exchangeId, logLevel))
+		, m_exchangeId(exchangeId)
+		, m_serverId(serverId)
+		, m_listen(-1)
+		, m_epoll(-1)
+		, m_roundId(1)
+		, m_schedule(schedule ? schedule : std::make_shared<RoundSchedule>(std::random_device()()))
+		// Ties between winners are broken from the same seed, so whole runs repeat
+		, m_rng(m_schedule->Seed())
+		, m_readChunk(1<<16)
+	{
+		m_epoll=epoll_create1(0);
+		if(m_epoll==-1)
+			Throw<std::runtime_error>()<<"EndpointExchange - Couldn't create epoll instance, errno="<<errno;
+		try{
+			m_listen=OpenListener(spec);
+			Watch(m_listen, EPOLLIN, EPOLL_CTL_ADD);
+		}catch(...){
+			if(m_listen!=-1)
+				close(m_listen);
+			close(m_epoll);
+			throw;
+		}
+	}
+
+	~EndpointExchange()
+	{
+		for(auto &kv : m_clients){
+			close(kv.first);
+		}
+		close(m_listen);
+		close(m_epoll);
+	}
+
+	void Run()
+	{
+		try{
+			Log(Log_Info, "Exchange running, exchangeId=%s, serverId=%s", m_exchangeId.c_str(), m_serverId.c_str());
+			while(1){
+				// Nothing to do until somebody is here
+				while(CountConnected()==0){
+					Poll(-1);
+				}
+				RunRound();
+			}
+		}catch(std::exception &e){
+			Log(Log_Fatal, "Exception : %s.", e.what());
+			throw;
+		}
+	}
+};
+
+#endif
+
+}; // bitecoin
+
+#endif
@@ -12,11 +12,23 @@
 #include <memory>
 
 #include "bitecoin_protocol.hpp"
+#include "bitecoin_endpoint.hpp"
 
 #include "bitecoin_hashing.hpp"
+#include "bitecoin_round_schedule.hpp"
 
 namespace bitecoin{
 
+/*! Whether bid a should be kept over bid b. Anything that arrived by the deadline beats
+	anything that didn't, and after that the lower proof wins. */
+bool IsBetterBid(const submission_t &a, const submission_t &b, timestamp_t deadline)
+{
+	bool aLate=a.timeRecv > deadline, bLate=b.timeRecv > deadline;
+	if(aLate!=bLate)
+		return bLate;
+	return wide_compare(BIGINT_WORDS, a.proof, b.proof) < 0;
+}
+
 class EndpointServer
 	: public Endpoint
 {
@@ -27,11 +39,12 @@ private:
 	uint32_t m_protocol;
 	std::string m_exchangeId, m_serverId;
 	std::string m_clientId, m_minerId;
+	std::shared_ptr<RoundSchedule> m_schedule;
 
-	void CheckSubmission(const Packet_ServerBeginRound *pBeginRound, const submission_t &subClient)
+	void CheckSubmission(const HashContext &context, const submission_t &subClient)
 	{
 		Log(Log_Debug, "Starting to re-hash data.\n");
-		bigint_t correct=HashReference(pBeginRound,subClient.solution.size(), &subClient.solution[0]);
+		bigint_t correct=context.Hash(subClient.solution.size(), subClient.solution.data());
 		Log(Log_Debug, "Rehash done.\n");
 		
 		if(memcmp(correct.limbs, subClient.proof, BIGINT_LENGTH)){
@@ -47,11 +60,13 @@ public:
 			std::string exchangeId,
 			std::string serverId,
 			std::unique_ptr<Connection> &conn,
-			int logLevel=1
+			int logLevel=1,
+			std::shared_ptr<RoundSchedule> schedule=std::shared_ptr<RoundSchedule>()
 		)
 		: Endpoint(conn, std::make_shared<LogDest>(exchangeId, logLevel))
 		, m_exchangeId(exchangeId)
 		, m_serverId(serverId)
+		, m_schedule(schedule ? schedule : std::make_shared<RoundSchedule>(std::random_device()()))
 	{}
 		
 	void Run()
@@ -65,6 +80,7 @@ public:
 			Log(Log_Info, "Received connection from clientId=%s, minerId=%s\n", m_clientId.c_str(), m_minerId.c_str());		
 			
 			auto completeConnect = std::make_shared<Packet_ServerCompleteConnect>(m_exchangeId, m_serverId);
+			completeConnect->protocolVersion=ProtocolVersion_Ping;
 			SendPacket(completeConnect);
 			
 			Log(Log_Verbose, "Connected to client.");
@@ -74,29 +90,14 @@ public:
 			while(1){
 				Log(Log_Info, "Starting round %llu.", roundId);
 				
-				auto beginRound=std::make_shared<Packet_ServerBeginRound>();
-				beginRound->roundId=roundId;
-				beginRound->roundSalt=rand();
-				beginRound->chainData.resize(16+(rand()%1000));
-				beginRound->maxIndices=16;
-				memset(beginRound->c, 0, BIGINT_LENGTH/2);
-				// These are just arbitrary values. The real exchange may choose
-				// different ones
-				beginRound->c[0]=4294964621;
-				beginRound->c[1]=4294967295;
-				beginRound->c[2]=3418534911;
-				beginRound->c[3]=2138916474;
-				// Again exchange might choose differently
-				beginRound->hashSteps=16+rand()%16;
+				auto beginRound=m_schedule->MakeBeginRound(roundId);
 
 				Log(Log_Verbose, "Sending chain data.\n");
 				SendPacket(beginRound);
 				
 				auto requestBid=std::make_shared<Packet_ServerRequestBid>();
 
-				double roundLength=(rand()+1.0)/RAND_MAX;
-				roundLength=-log(roundLength)*2.75+0.25;
-				roundLength=std::max(0.25, std::min(60.0, roundLength));
+				double roundLength=m_schedule->MakeRoundLength();
 				
 				timestamp_t start=now();
 				timestamp_t finish=uint64_t(start+roundLength*1e9);
@@ -110,23 +111,54 @@ public:
 				SendPacket(requestBid);
 				Log(Log_Verbose, "Requested bids.\n");
 
-				auto bid=RecvPacket<Packet_ClientSendBid>();
-				timestamp_t timeRecv=now();
-				Log(Log_Verbose, "Received bid.\n");
+				/* Any number of improved bids can come before the final one. Checking a bid
+					is a full hash on this thread, and pings wait behind it, so a bid is only
+					checked if what it claims would beat the best kept so far. One that
+					doesn't couldn't win anyway. */
+				HashContext context(beginRound.get());
+				submission_t subClient;
+				unsigned nBids=0, nChecked=0;
+				while(1){
+					auto packet=RecvPacket();
+					timestamp_t timeRecv=now();
+					
+					if(auto ping=std::dynamic_pointer_cast<Packet_ClientPing>(packet)){
+						Packet_ServerPong pong;
+						pong.pingId=ping->pingId;
+						pong.timeClientSent=ping->timeSent;
+						pong.timeServerRecv=timeRecv;
+						pong.timeServerSent=now();
+						SendPacket(pong);
+						continue;
+					}
+					
+					auto bid=std::dynamic_pointer_cast<Packet_ClientSendBid>(packet);
+					if(!bid)
+						Throw<std::runtime_error>()<<"EndpointServer::Run - Expected bid or ping, but got "<<typeid(*packet).name()<<".";
+					bool isFinal= bid->CommandId()==Command_ClientSendBid;
+					nBids++;
+					
+					submission_t sub;
+					sub.clientId=m_clientId.c_str();
+					sub.solution = bid->solution;
+					memcpy(sub.proof, bid->proof, BIGINT_LENGTH);
+					sub.timeSent=bid->timeSent;
+					sub.timeRecv=timeRecv;
+					
+					if(nBids==1 || IsBetterBid(sub, subClient, finish)){
+						CheckSubmission(context, sub);
+						nChecked++;
+						subClient=sub;
+					}
+					if(isFinal)
+						break;
+				}
+				Log(Log_Verbose, "Received %u bids, checked %u.\n", nBids, nChecked);
 				
-				if(timeRecv > finish){
+				if(subClient.timeRecv > finish){
 					Log(Log_Info, "Client bid too late.\n");
 				}
 				
-				submission_t subClient;
-				subClient.clientId=m_clientId.c_str();
-				subClient.solution = bid->solution;
-				memcpy(subClient.proof, bid->proof, BIGINT_LENGTH);
-				subClient.timeSent=bid->timeSent;
-				subClient.timeRecv=timeRecv;
-				
-				CheckSubmission(beginRound.get(), subClient);
-				
 				auto summary=std::make_shared<Packet_ServerCompleteRound>();
 				summary->roundId=roundId;
 				summary->winner=subClient;
@@ -134,6 +166,7 @@ public:
 				
 				SendPacket(summary);
 				Log(Log_Info, "Round complete.\n");
+				LogConnectionStats(Log_Verbose);
 					
 				roundId++;
 			}
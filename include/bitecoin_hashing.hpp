@@ -10,8 +10,15 @@
 #include "wide_int.h"
 
 #include <cstdint>
+#include <cmath>
 #include <stdexcept>
 #include <algorithm>
+#include <vector>
+#include <random>
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_scan.h"
 
 #include "bitecoin_protocol.hpp"
 
@@ -102,35 +109,157 @@ namespace bitecoin{
 		return acc;
 	}
 	
+	/*! Everything about the hash in a round that doesn't depend on the index. PoolHash
+		re-hashes all of the chain data for every single index, which is most of the work
+		when hashSteps is small, so anything checking lots of proofs for the same round
+		should build one of these first. Gives exactly the same answers as HashReference.
+	*/
+	class HashContext
+	{
+	private:
+		uint32_t m_c[NLIMBS/2];
+		unsigned m_hashSteps, m_maxIndices;
+		bigint_t m_base;	// The starting point with an index of zero
+	public:
+		HashContext(const Packet_ServerBeginRound *pParams)
+			: m_hashSteps(pParams->hashSteps)
+			, m_maxIndices(pParams->maxIndices)
+		{
+			wide_copy(NLIMBS/2, m_c, pParams->c);
+			
+			// Built exactly as in PoolHash, but with no index and no stepping
+			hash::fnv<64> hasher;
+			uint64_t chainHash=hasher((const char*)&pParams->chainData[0], pParams->chainData.size());
+			wide_zero(8, m_base.limbs);
+			wide_add(6, m_base.limbs+2, m_base.limbs+2, pParams->roundId);
+			wide_add(4, m_base.limbs+4, m_base.limbs+4, pParams->roundSalt);
+			wide_add(2, m_base.limbs+6, m_base.limbs+6, chainHash);
+		}
+		
+		//! Same as PoolHash(pParams, index)
+		bigint_t PoolHash(uint32_t index) const
+		{
+			// The index only ever lands in the bottom limb, nothing else can carry into it
+			bigint_t x=m_base;
+			x.limbs[0]=index;
+			
+			bigint_t tmp;
+			for(unsigned j=0;j<m_hashSteps;j++){
+				wide_mul(4, tmp.limbs+4, tmp.limbs, x.limbs, m_c);
+				uint32_t carry=wide_add(4, x.limbs, tmp.limbs, x.limbs+4);
+				wide_add(4, x.limbs+4, tmp.limbs+4, carry);
+			}
+			return x;
+		}
+		
+		//! Same as HashReference(pParams, nIndices, pIndices), including the checks
+		bigint_t Hash(unsigned nIndices, const uint32_t *pIndices) const
+		{
+			if(nIndices>m_maxIndices)
+				throw std::invalid_argument("HashContext::Hash - Too many indices for parameter set.");
+			
+			bigint_t acc;
+			wide_zero(8, acc.limbs);
+			for(unsigned i=0;i<nIndices;i++){
+				if(i>0){
+					if(pIndices[i-1] >= pIndices[i])
+						throw std::invalid_argument("HashContext::Hash - Indices are not in monotonically increasing order.");
+				}
+				bigint_t point=PoolHash(pIndices[i]);
+				wide_xor(8, acc.limbs, acc.limbs, point.limbs);
+			}
+			return acc;
+		}
+	};
+	
+	namespace detail{
+		
+		// Running total of the weights for tbb::parallel_scan, written to pPrefix on the final pass
+		class WeightScan
+		{
+		private:
+			const double *m_pWeights;
+			double *m_pPrefix;
+			double m_sum;
+		public:
+			WeightScan(const double *pWeights, double *pPrefix)
+				: m_pWeights(pWeights)
+				, m_pPrefix(pPrefix)
+				, m_sum(0)
+			{}
+			
+			WeightScan(WeightScan &o, tbb::split)
+				: m_pWeights(o.m_pWeights)
+				, m_pPrefix(o.m_pPrefix)
+				, m_sum(0)
+			{}
+			
+			template<class TTag>
+			void operator()(const tbb::blocked_range<size_t> &r, TTag)
+			{
+				double acc=m_sum;
+				for(size_t i=r.begin();i!=r.end();i++){
+					acc+=m_pWeights[i];
+					if(TTag::is_final_scan())
+						m_pPrefix[i]=acc;
+				}
+				m_sum=acc;
+			}
+			
+			void reverse_join(WeightScan &left)
+			{ m_sum=left.m_sum+m_sum; }
+			
+			void assign(WeightScan &o)
+			{ m_sum=o.m_sum; }
+			
+			double Sum() const
+			{ return m_sum; }
+		};
+		
+	}; // detail
+	
 	/*! This is used to choose the winner. It is somewhat biased against the very fastest
 		people, so that it is still possible for slow people to occasionally win a coin.
 		\param rng returns an double-precision uniform random in [0,1)
 		\note It is basically choosing in proportion to the sqrt of the inverse fitness.
 			So if there are three people, with effective hash rates of 1000, 100, and 10,
 			then the probability of each winning a coin is 7%, 22%, and 70%
+		\note Each choice wins with its share of the total weight whatever order they are
+			in, so there is no need to sort. Big rounds work out the weights and their
+			running total in parallel, and the draw is a binary search of the running total.
 	*/
 	template<class TRng>
 	unsigned ChooseWinner(const std::vector<bigint_t> &choices, TRng &rng)
 	{
-		std::vector<std::pair<double,unsigned> > values;
-		for(unsigned i=0;i<choices.size();i++){
-			values.push_back(std::make_pair(1.0 / wide_as_double(8, choices[i].limbs), i));
-		}
-		std::sort(values.begin(), values.end());
+		// Below this it isn't worth waking up the TBB workers
+		enum{ PARALLEL_MIN = 1<<14, GRAIN = 1<<12 };
+		
+		size_t n=choices.size();
+		std::vector<double> prefix(n);
 		double acc=0;
-		for(unsigned i=0;i<values.size();i++){
-			acc+=sqrt(values[i].first);
-			values[i].first=acc;
+		if(n<PARALLEL_MIN){
+			for(size_t i=0;i<n;i++){
+				acc+=sqrt(1.0 / wide_as_double(8, choices[i].limbs));
+				prefix[i]=acc;
+			}
+		}else{
+			std::vector<double> weights(n);
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, n, GRAIN), [&](const tbb::blocked_range<size_t> &r){
+				for(size_t i=r.begin();i!=r.end();i++){
+					weights[i]=sqrt(1.0 / wide_as_double(8, choices[i].limbs));
+				}
+			});
+			detail::WeightScan scan(&weights[0], &prefix[0]);
+			tbb::parallel_scan(tbb::blocked_range<size_t>(0, n, GRAIN), scan);
+			acc=scan.Sum();
 		}
 		
 		std::uniform_real_distribution<double> distribution(0.0,acc);
 		
 		double sel=distribution(rng);
-		for(unsigned i=0;i<values.size();i++){
-			if(sel<=values[i].first)
-				return values[i].second;
-		}
-		return values.back().second;
+		// First one whose running total reaches sel, as the old linear scan did
+		size_t i=std::lower_bound(prefix.begin(), prefix.end(), sel)-prefix.begin();
+		return unsigned(std::min(i, n-1));
 	}
 	
 };
@@ -11,6 +11,7 @@
 #include <time.h>
 
 #include <sstream>
+#include <mutex>
 
 namespace bitecoin{
 	
@@ -61,26 +62,30 @@ namespace bitecoin{
 		struct timespec ts;
 		if(0!=clock_gettime(CLOCK_REALTIME, &ts))
 			throw std::runtime_error("bitecoin::now() - Couldn't read time."); 
-		return uint64_t(1e9*ts.tv_sec+ts.tv_nsec);
+		// Integer arithmetic, as a double only resolves to 256ns at this magnitude
+		return uint64_t(ts.tv_sec)*1000000000ULL+ts.tv_nsec;
 	}
 #endif
 
 	
+	class PacketPool;
+	
 	class Packet{
 	private:
 		struct send_context_t{
 			uint64_t length;
 			uint32_t sentinel;
 			uint64_t beginOffset;
+			uint32_t header[4];	// length (hi,lo), command and sentinel, in network order
+			uint32_t footer;		// sentinel, in network order
 		};
 	
-		send_context_t BeginSend(Connection *pConnection) const
+		// The header and footer live in the context, which must outlive the whole send
+		void BeginSend(Connection *pConnection, send_context_t &context) const
 		{
-			send_context_t context={
-				Length(),
-				uint32_t(clock()+rand()),
-				pConnection->SendOffset()
-			}	;
+			context.length=Length();
+			context.sentinel=uint32_t(clock()+rand());
+			context.beginOffset=pConnection->SendOffset();
 			while(context.sentinel==0){
 			  context.sentinel=uint32_t(clock()+rand());
 			}
@@ -89,18 +94,19 @@ namespace bitecoin{
 				throw std::logic_error("Packet::BeginSend - Cannot have a length of less than 20 bytes.");
 			
 			uint32_t command=CommandId();
-			pConnection->Send(context.length);
-			pConnection->Send(command);
-			pConnection->Send(context.sentinel);
+			context.header[0]=htonl(uint32_t(context.length>>32));
+			context.header[1]=htonl(uint32_t(context.length&0xFFFFFFFFull));
+			context.header[2]=htonl(command);
+			context.header[3]=htonl(context.sentinel);
+			context.footer=htonl(context.sentinel);
+			pConnection->BeginPacket(sizeof(context.header), context.header);
 			
 			//fprintf(stderr, "Sent[length=%llu, command=%u, sentinel=%u\n", context.length, command, context.sentinel);
-			
-			return context;
 		}
 		
 		void EndSend(Connection *pConnection, const send_context_t &ctxt) const
 		{
-			pConnection->Send(ctxt.sentinel);
+			pConnection->EndPacket(sizeof(ctxt.footer), &ctxt.footer);
 			
 			uint64_t endOffset=pConnection->SendOffset();
 			if(endOffset<ctxt.beginOffset)
@@ -114,7 +120,10 @@ namespace bitecoin{
 			}
 		}
 		
+		friend class PacketPool;
+		
 		static std::shared_ptr<Packet> CreatePacket(uint32_t command);
+		static std::shared_ptr<Packet> CreatePacket(uint32_t command, PacketPool *pPool);
 		
 		void operator=(const Packet&); // = delete; // no implementation
 		Packet(const Packet &); // = delete;
@@ -125,6 +134,11 @@ namespace bitecoin{
 		virtual void SendPayload(Connection *pConnection) const =0;
 		virtual void RecvPayload(Connection *pConnection) =0;
 		
+		/*! Packets find their own length as they decode, but one that wants the whole payload
+			in one go can override this instead. */
+		virtual void RecvPayloadSized(Connection *pConnection, uint64_t /*payloadLength*/)
+		{ RecvPayload(pConnection); }
+		
 		virtual uint64_t PayloadLength() const =0;
 	public:
 		virtual uint32_t CommandId() const=0;
@@ -134,18 +148,32 @@ namespace bitecoin{
 	
 		void Send(Connection *pConnection) const
 		{
-			send_context_t ctxt=BeginSend(pConnection);
+			// Time spent blocked in the transport is counted separately, so leave it out
+			ConnectionStats &stats=pConnection->Stats();
+			uint64_t t0=ConnectionStats::Clock(), blocked0=stats.SendBlockedNs();
+			
+			send_context_t ctxt;
+			BeginSend(pConnection, ctxt);
 			SendPayload(pConnection);
 			EndSend(pConnection, ctxt);
+			
+			uint64_t elapsed=ConnectionStats::Clock()-t0, blocked=stats.SendBlockedNs()-blocked0;
+			stats.OnPacketSent(CommandId(), ctxt.length, elapsed>blocked ? elapsed-blocked : 0);
 		}
 	
-		static std::shared_ptr<Packet> Recv(Connection *pConnection)
+		/*! If there is a pool the packet might be one that was returned before, so anything
+			that needs to survive the next few packets of the same type should be copied. */
+		static std::shared_ptr<Packet> Recv(Connection *pConnection, PacketPool *pPool=0)
 		{
 			uint64_t length=0;
 			uint32_t command=0, sentinelHeader=0, sentinelFooter=0;
 			
 			uint64_t beginOffset=pConnection->RecvOffset();
 			
+			// Includes waiting for the packet to turn up, but that is blocked time and taken off
+			ConnectionStats &stats=pConnection->Stats();
+			uint64_t t0=ConnectionStats::Clock(), blocked0=stats.RecvBlockedNs();
+			
 			pConnection->Recv(length);
 			pConnection->Recv(command);
 			pConnection->Recv(sentinelHeader);
@@ -155,9 +183,9 @@ namespace bitecoin{
 			if(length<20)
 				throw std::runtime_error("Packet::Recv - Received packet length of < 20 bytes, which is not possible.");
 			
-			std::shared_ptr<Packet> res=CreatePacket(command);
+			std::shared_ptr<Packet> res=CreatePacket(command, pPool);
 			
-			res->RecvPayload(pConnection);
+			res->RecvPayloadSized(pConnection, length-20);
 			
 			pConnection->Recv(sentinelFooter);
 			if(sentinelHeader!=sentinelFooter)
@@ -170,6 +198,9 @@ namespace bitecoin{
 			if(endOffset-beginOffset != length)
 				throw std::runtime_error("Packet::Recv - Sent bytes does not match what we said in the header.");
 			
+			uint64_t elapsed=ConnectionStats::Clock()-t0, blocked=stats.RecvBlockedNs()-blocked0;
+			stats.OnPacketRecv(command, length, elapsed>blocked ? elapsed-blocked : 0);
+			
 			return res;
 		}
 	};
@@ -185,7 +216,41 @@ namespace bitecoin{
 		Command_ServerBeginRound=4,	// Sent to all clients to start a mining round
 		Command_ServerRequestBid=5,	// Sent to all clients to tell them the server wants  a bid
 		Command_ClientSendBid=6,	// Sent by a client to indicate their response from a mining round
-		Command_ServerCompleteRound=7		// Sent to all clients once round has finished
+		Command_ServerCompleteRound=7,		// Sent to all clients once round has finished
+		
+		Command_ClientImproveBid=8,	// Sent by a client during the bid window, only if the server supports it
+		
+		Command_ClientPing=9,	// Sent by a client to measure round trip time and clock offset
+		Command_ServerPong=10,	// Immediate reply to a ClientPing
+		
+		Command_max=Command_ServerPong
+	};
+	
+	//! For logging
+	const char *CommandName(uint32_t command)
+	{
+		switch(command){
+		case Command_ServerError: return "ServerError";
+		case Command_ClientBeginConnect: return "ClientBeginConnect";
+		case Command_ServerCompleteConnect: return "ServerCompleteConnect";
+		case Command_ServerBeginRound: return "ServerBeginRound";
+		case Command_ServerRequestBid: return "ServerRequestBid";
+		case Command_ClientSendBid: return "ClientSendBid";
+		case Command_ServerCompleteRound: return "ServerCompleteRound";
+		case Command_ClientImproveBid: return "ClientImproveBid";
+		case Command_ClientPing: return "ClientPing";
+		case Command_ServerPong: return "ServerPong";
+		default: return "Other";
+		}
+	}
+	
+	/*! Levels for Packet_ServerCompleteConnect::protocolVersion. The client's protocolVersion
+		is not sent on the wire, so the server says what it supports and the client decides
+		whether to use it. A client that ignores it just sees the basic protocol. */
+	enum{
+		ProtocolVersion_Basic=0,
+		ProtocolVersion_StreamBids=1,	// Client may send any number of ClientImproveBid before its ClientSendBid
+		ProtocolVersion_Ping=2		// As above, plus the client may send ClientPing during the bid window
 	};
 	
 	/*! After this packet is sent the connection is effectively shut, no further traffic is possible */
@@ -295,9 +360,7 @@ namespace bitecoin{
 			pConnection->Recv(roundSalt);
 			pConnection->Recv(chainData);
 			pConnection->Recv(maxIndices);
-			for(unsigned i=0;i<BIGINT_WORDS/2;i++){
-				pConnection->Recv(c[i]);
-			}
+			pConnection->RecvWords(BIGINT_WORDS/2, c);
 			pConnection->Recv(hashSteps);
 		}	
 	
@@ -307,9 +370,7 @@ namespace bitecoin{
 			pConnection->Send(roundSalt);
 			pConnection->Send(chainData);
 			pConnection->Send(maxIndices);
-			for(unsigned i=0;i<BIGINT_WORDS/2;i++){
-				pConnection->Send(c[i]);
-			}
+			pConnection->SendWords(BIGINT_WORDS/2, c);
 			pConnection->Send(hashSteps);
 		}
 		
@@ -321,7 +382,7 @@ namespace bitecoin{
 	
 		uint64_t roundId;				// unique id associated with this round.
 		uint64_t roundSalt;			// Random value chosen by the server
-		std::vector<uint8_t> chainData;	// Chain data. On the wire consists of 64-bit length, followed by bytes of chain data
+		byte_vector_t chainData;	// Chain data. On the wire consists of 64-bit length, followed by bytes of chain data
 		uint32_t maxIndices;			// Maximum indices to return 
 		uint32_t c[BIGINT_WORDS/2];		// Constant to use during hashing
 		uint32_t hashSteps;				// Number of times to hash per point
@@ -361,9 +422,7 @@ namespace bitecoin{
 		{
 			pConnection->Recv(roundId);
 			pConnection->Recv(solution);
-			for(unsigned i=0;i<BIGINT_WORDS;i++){
-				pConnection->Recv(proof[i]);
-			}
+			pConnection->RecvWords(BIGINT_WORDS, proof);
 			pConnection->Recv(timeSent);
 		}		
 	
@@ -371,9 +430,7 @@ namespace bitecoin{
 		{
 			pConnection->Send(roundId);
 			pConnection->Send(solution);
-			for(unsigned i=0;i<BIGINT_WORDS;i++){
-				pConnection->Send(proof[i]);
-			}
+			pConnection->SendWords(BIGINT_WORDS, proof);
 			pConnection->Send(timeSent);
 		}	
 		
@@ -389,6 +446,77 @@ namespace bitecoin{
 		timestamp_t timeSent;	// When the client purports to have sent this
 	};
 	
+	/*! A provisional bid, which can be sent whenever the client finds something better. The
+		server keeps the best valid bid received before timeStampReceiveBids, including the
+		final ClientSendBid, which must still be sent to finish the client's round. */
+	class Packet_ClientImproveBid
+		: public Packet_ClientSendBid
+	{
+	public:
+		virtual uint32_t CommandId() const override
+		{ return Command_ClientImproveBid; }
+	};
+	
+	class Packet_ClientPing
+		: public Packet
+	{
+	protected:
+		virtual void RecvPayload(Connection *pConnection) override
+		{
+			pConnection->Recv(pingId);
+			pConnection->Recv(timeSent);
+		}
+	
+		virtual void SendPayload(Connection *pConnection) const override
+		{
+			pConnection->Send(pingId);
+			pConnection->Send(timeSent);
+		}
+		
+		virtual uint64_t PayloadLength() const override
+		{ return 4+sizeof(timestamp_t); }
+	public:
+		virtual uint32_t CommandId() const override
+		{ return Command_ClientPing; }
+		
+		uint32_t pingId;		// Chosen by the client, echoed back in the pong
+		timestamp_t timeSent;	// Client's clock when sent
+	};
+	
+	/*! The four timestamps are what NTP uses: the client's send and receive times, and the
+		server's receive and send times in between. */
+	class Packet_ServerPong
+		: public Packet
+	{
+	protected:
+		virtual void RecvPayload(Connection *pConnection) override
+		{
+			pConnection->Recv(pingId);
+			pConnection->Recv(timeClientSent);
+			pConnection->Recv(timeServerRecv);
+			pConnection->Recv(timeServerSent);
+		}
+	
+		virtual void SendPayload(Connection *pConnection) const override
+		{
+			pConnection->Send(pingId);
+			pConnection->Send(timeClientSent);
+			pConnection->Send(timeServerRecv);
+			pConnection->Send(timeServerSent);
+		}
+		
+		virtual uint64_t PayloadLength() const override
+		{ return 4+3*sizeof(timestamp_t); }
+	public:
+		virtual uint32_t CommandId() const override
+		{ return Command_ServerPong; }
+		
+		uint32_t pingId;
+		timestamp_t timeClientSent;	// Copied from the ping
+		timestamp_t timeServerRecv;	// Server's clock when the ping arrived
+		timestamp_t timeServerSent;	// Server's clock when the pong was sent
+	};
+	
 	struct submission_t
 	{
 		std::string clientId;
@@ -401,9 +529,7 @@ namespace bitecoin{
 		{
 			pConnection->Send(clientId);
 			pConnection->Send(solution);
-			for(unsigned i=0;i<BIGINT_WORDS;i++){
-				pConnection->Send(proof[i]);
-			}
+			pConnection->SendWords(BIGINT_WORDS, proof);
 			pConnection->Send(timeSent);
 			pConnection->Send(timeRecv);
 		}
@@ -412,9 +538,7 @@ namespace bitecoin{
 		{
 			pConnection->Recv(clientId);
 			pConnection->Recv(solution);
-			for(unsigned i=0;i<BIGINT_WORDS;i++){
-				pConnection->Recv(proof[i]);
-			}
+			pConnection->RecvWords(BIGINT_WORDS, proof);
 			pConnection->Recv(timeSent);
 			pConnection->Recv(timeRecv);
 		}
@@ -459,6 +583,184 @@ namespace bitecoin{
 		std::vector<submission_t> submissions;	// On the wire is a 64-bit length, followed by submissions
 	};
 	
+	/*! The same packet as Packet_ServerCompleteRound, but decoded into one flat buffer. The
+		payload is read in a single Recv and then indexed, and the accessors work straight
+		from the buffer, so however many submissions there are the only allocations are the
+		buffer and index growing. Nothing is copied out unless asked for.
+	*/
+	class Packet_ServerCompleteRoundFlat
+		: public Packet
+	{
+	private:
+		// Anything bigger than this is a broken or hostile server
+		enum{ MAX_PAYLOAD = 1<<28 };
+		
+		// Where each submission's fields are in the payload
+		struct entry_t
+		{
+			uint32_t idOffset;
+			uint32_t idLength;
+			uint32_t solutionOffset;
+			uint32_t solutionLength;	// In words
+			uint32_t proofOffset;		// Followed by timeSent and timeRecv
+		};
+		
+		byte_vector_t m_payload;
+		std::vector<entry_t> m_entries;	// The winner, then the submissions
+		
+		uint32_t ReadWord(size_t offset) const
+		{
+			uint32_t x;
+			memcpy(&x, &m_payload[offset], 4);
+			return ntohl(x);
+		}
+		
+		uint64_t ReadU64(size_t offset) const
+		{ return (uint64_t(ReadWord(offset))<<32) | ReadWord(offset+4); }
+		
+		void Need(size_t offset, uint64_t n) const
+		{
+			if(offset+n > m_payload.size())
+				throw std::runtime_error("Packet_ServerCompleteRoundFlat - Payload is too short for its contents.");
+		}
+		
+		size_t IndexSubmission(size_t offset)
+		{
+			entry_t e;
+			
+			Need(offset, 4);
+			e.idLength=ReadWord(offset);
+			offset+=4;
+			Need(offset, e.idLength);
+			e.idOffset=offset;
+			for(unsigned i=0;i<e.idLength;i++){
+				char c=m_payload[offset+i];
+				if(!(isprint(c) || isspace(c)))
+					throw std::runtime_error("Packet_ServerCompleteRoundFlat - Non printable character in client id.");
+			}
+			offset+=e.idLength;
+			
+			Need(offset, 4);
+			e.solutionLength=ReadWord(offset);
+			offset+=4;
+			Need(offset, 4*uint64_t(e.solutionLength));
+			e.solutionOffset=offset;
+			offset+=4*e.solutionLength;
+			
+			Need(offset, BIGINT_LENGTH+2*sizeof(timestamp_t));
+			e.proofOffset=offset;
+			offset+=BIGINT_LENGTH+2*sizeof(timestamp_t);
+			
+			m_entries.push_back(e);
+			return offset;
+		}
+		
+		void Index()
+		{
+			m_entries.clear();
+			Need(0, 8);
+			size_t offset=IndexSubmission(8);
+			Need(offset, 4);
+			uint32_t n=ReadWord(offset);
+			offset+=4;
+			for(unsigned i=0;i<n;i++){
+				offset=IndexSubmission(offset);
+			}
+			if(offset!=m_payload.size())
+				throw std::runtime_error("Packet_ServerCompleteRoundFlat - Payload has trailing data.");
+		}
+	protected:
+		virtual void RecvPayloadSized(Connection *pConnection, uint64_t payloadLength) override
+		{
+			if(payloadLength>MAX_PAYLOAD)
+				throw std::runtime_error("Packet_ServerCompleteRoundFlat - Payload is too large.");
+			m_payload.resize(payloadLength);
+			pConnection->Recv(payloadLength, m_payload.data());
+			Index();
+		}
+		
+		virtual void RecvPayload(Connection * /*pConnection*/) override
+		{
+			throw std::logic_error("Packet_ServerCompleteRoundFlat::RecvPayload - Needs to know the payload length.");
+		}
+		
+		// The buffer is already in wire format
+		virtual void SendPayload(Connection *pConnection) const override
+		{
+			pConnection->Send(m_payload.size(), m_payload.data());
+		}
+		
+		virtual uint64_t PayloadLength() const override
+		{ return m_payload.size(); }
+	public:
+		virtual uint32_t CommandId() const override
+		{ return Command_ServerCompleteRound; }
+		
+		//! Read-only view of one submission, only valid until the packet is decoded into again
+		class submission_view_t
+		{
+		private:
+			friend class Packet_ServerCompleteRoundFlat;
+			
+			const Packet_ServerCompleteRoundFlat *m_pPacket;
+			const entry_t *m_pEntry;
+			
+			submission_view_t(const Packet_ServerCompleteRoundFlat *pPacket, const entry_t *pEntry)
+				: m_pPacket(pPacket)
+				, m_pEntry(pEntry)
+			{}
+		public:
+			//! Not null terminated
+			const char *ClientId() const
+			{ return (const char*)&m_pPacket->m_payload[m_pEntry->idOffset]; }
+			
+			unsigned ClientIdLength() const
+			{ return m_pEntry->idLength; }
+			
+			bool ClientIdEquals(const std::string &id) const
+			{ return id.size()==m_pEntry->idLength && 0==memcmp(id.data(), ClientId(), id.size()); }
+			
+			unsigned SolutionLength() const
+			{ return m_pEntry->solutionLength; }
+			
+			uint32_t Solution(unsigned i) const
+			{ return m_pPacket->ReadWord(m_pEntry->solutionOffset+4*i); }
+			
+			void GetSolution(std::vector<uint32_t> &solution) const
+			{
+				solution.resize(m_pEntry->solutionLength);
+				if(solution.empty())
+					return;
+				memcpy(&solution[0], &m_pPacket->m_payload[m_pEntry->solutionOffset], 4*solution.size());
+				detail::swap_words(solution.size(), &solution[0], &solution[0]);
+			}
+			
+			void GetProof(uint32_t *pProof) const
+			{
+				memcpy(pProof, &m_pPacket->m_payload[m_pEntry->proofOffset], BIGINT_LENGTH);
+				detail::swap_words(BIGINT_WORDS, pProof, pProof);
+			}
+			
+			timestamp_t TimeSent() const
+			{ return m_pPacket->ReadU64(m_pEntry->proofOffset+BIGINT_LENGTH); }
+			
+			timestamp_t TimeRecv() const
+			{ return m_pPacket->ReadU64(m_pEntry->proofOffset+BIGINT_LENGTH+sizeof(timestamp_t)); }
+		};
+		
+		uint64_t RoundId() const
+		{ return ReadU64(0); }
+		
+		submission_view_t Winner() const
+		{ return submission_view_t(this, &m_entries.at(0)); }
+		
+		unsigned SubmissionCount() const
+		{ return m_entries.empty() ? 0 : m_entries.size()-1; }
+		
+		submission_view_t Submission(unsigned i) const
+		{ return submission_view_t(this, &m_entries.at(i+1)); }
+	};
+	
 	std::shared_ptr<Packet> Packet::CreatePacket(uint32_t command)
 	{
 		switch(command){
@@ -476,6 +778,12 @@ namespace bitecoin{
 			return std::make_shared<Packet_ClientSendBid>();
 		case Command_ServerCompleteRound:
 			return std::make_shared<Packet_ServerCompleteRound>();
+		case Command_ClientImproveBid:
+			return std::make_shared<Packet_ClientImproveBid>();
+		case Command_ClientPing:
+			return std::make_shared<Packet_ClientPing>();
+		case Command_ServerPong:
+			return std::make_shared<Packet_ServerPong>();
 		default:
 			{
 				std::stringstream acc;
@@ -484,8 +792,180 @@ namespace bitecoin{
 			}
 		};
 	}
-
+	
+	/*! Hands out packets to decode into, reusing ones that have been given back.
+		A packet goes back to the pool when the last shared_ptr to it is dropped, through
+		the deleter, in whichever thread drops it. The client hands packets from its network
+		thread to the miner and main threads, so the free lists are behind a mutex, which also
+		makes sure everything the last holder did with a packet is done before it is decoded
+		into again. The strings and vectors inside keep their capacity, and the shared_ptr
+		control blocks come from a free list of their own, so once a connection has seen a
+		few rounds decoding doesn't allocate at all. The free lists are shared with the
+		packets handed out, so packets can outlive the pool, and whatever is left is freed
+		along with the last of them.
+	*/
+	class PacketPool
+	{
+	private:
+		PacketPool(const PacketPool &); // = delete;
+		void operator=(const PacketPool &); // = delete;
+		
+		// Someone might hold on to the last round's packets while this round's arrive, and
+		// beyond this many of one type the extras are just deleted.
+		enum{ MAX_PER_COMMAND = 4 };
+		
+		// Every control block is the same type, so the same size. This is comfortably more
+		// than libstdc++ needs, and anything bigger just goes to the heap.
+		enum{ BLOCK_SIZE = 128, MAX_BLOCKS = (Command_max+1)*MAX_PER_COMMAND*2 };
+		
+		struct free_t
+		{
+			std::mutex mutex;
+			std::vector<std::shared_ptr<Packet> > packets[Command_max+1];
+			std::vector<void*> blocks;	// Spare control blocks, each BLOCK_SIZE bytes
+			bool flatCompleteRound;
+			
+			~free_t()
+			{
+				for(void *b : blocks){
+					::operator delete(b);
+				}
+			}
+		};
+		
+		// Owns the packet while it is handed out, and puts it back when the last user is done
+		struct Recycler
+		{
+			std::shared_ptr<free_t> free;
+			std::shared_ptr<Packet> packet;
+			uint32_t command;
+			bool flat;
+			
+			void operator()(Packet *)
+			{
+				{
+					std::lock_guard<std::mutex> lock(free->mutex);
+					std::vector<std::shared_ptr<Packet> > &packets=free->packets[command];
+					bool stale= command==Command_ServerCompleteRound && flat!=free->flatCompleteRound;
+					if(!stale && packets.size()<MAX_PER_COMMAND)
+						packets.push_back(std::move(packet));
+				}
+				packet.reset();
+			}
+		};
+		
+		// Hands the shared_ptr its control block from the free list, and takes it back
+		template<class T>
+		struct BlockAllocator
+		{
+			typedef T value_type;
+			
+			std::shared_ptr<free_t> free;
+			
+			BlockAllocator(const std::shared_ptr<free_t> &_free)
+				: free(_free)
+			{}
+			
+			template<class U>
+			BlockAllocator(const BlockAllocator<U> &other)
+				: free(other.free)
+			{}
+			
+			T *allocate(size_t n)
+			{
+				if(n*sizeof(T)>BLOCK_SIZE)
+					return (T*)::operator new(n*sizeof(T));
+				{
+					std::lock_guard<std::mutex> lock(free->mutex);
+					if(!free->blocks.empty()){
+						void *b=free->blocks.back();
+						free->blocks.pop_back();
+						return (T*)b;
+					}
+				}
+				return (T*)::operator new(BLOCK_SIZE);
+			}
+			
+			void deallocate(T *p, size_t n)
+			{
+				if(n*sizeof(T)<=BLOCK_SIZE){
+					std::lock_guard<std::mutex> lock(free->mutex);
+					if(free->blocks.size()<MAX_BLOCKS){
+						free->blocks.push_back(p);
+						return;
+					}
+				}
+				::operator delete(p);
+			}
+			
+			template<class U>
+			bool operator==(const BlockAllocator<U> &other) const
+			{ return free==other.free; }
+			
+			template<class U>
+			bool operator!=(const BlockAllocator<U> &other) const
+			{ return free!=other.free; }
+		};
+		
+		std::shared_ptr<free_t> m_free;
+	public:
+		PacketPool()
+			: m_free(std::make_shared<free_t>())
+		{
+			m_free->flatCompleteRound=false;
+			for(auto &v : m_free->packets){
+				v.reserve(MAX_PER_COMMAND);
+			}
+			m_free->blocks.reserve(MAX_BLOCKS);
+		}
+		
+		//! Decode ServerCompleteRound as Packet_ServerCompleteRoundFlat from now on
+		void SetFlatCompleteRound(bool flat)
+		{
+			std::lock_guard<std::mutex> lock(m_free->mutex);
+			if(flat!=m_free->flatCompleteRound)
+				m_free->packets[Command_ServerCompleteRound].clear();
+			m_free->flatCompleteRound=flat;
+		}
+		
+		std::shared_ptr<Packet> Get(uint32_t command)
+		{
+			if(command>Command_max)
+				return Packet::CreatePacket(command);	// Which will throw
+			
+			Recycler recycler;
+			recycler.free=m_free;
+			recycler.command=command;
+			{
+				std::lock_guard<std::mutex> lock(m_free->mutex);
+				recycler.flat=m_free->flatCompleteRound;
+				std::vector<std::shared_ptr<Packet> > &packets=m_free->packets[command];
+				if(!packets.empty()){
+					recycler.packet=std::move(packets.back());
+					packets.pop_back();
+				}
+			}
+			if(!recycler.packet){
+				if(command==Command_ServerCompleteRound && recycler.flat){
+					recycler.packet=std::make_shared<Packet_ServerCompleteRoundFlat>();
+				}else{
+					recycler.packet=Packet::CreatePacket(command);
+				}
+			}
+			Packet *p=recycler.packet.get();
+			return std::shared_ptr<Packet>(p, recycler, BlockAllocator<Packet>(m_free));
+		}
+	};
+	
+	std::shared_ptr<Packet> Packet::CreatePacket(uint32_t command, PacketPool *pPool)
+	{
+		return pPool ? pPool->Get(command) : CreatePacket(command);
+	}
 
 }; // bitecoin
 
+// Record, replay and sim decode packets, so they can only be defined once packets are
+#include "bitecoin_connection_replay.hpp"
+#include "bitecoin_connection_sim.hpp"
+
 #endif
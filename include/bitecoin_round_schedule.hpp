@@ -0,0 +1,332 @@
+#ifndef  bitecoin_round_schedule_hpp
+#define  bitecoin_round_schedule_hpp
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <random>
+#include <algorithm>
+
+#include "bitecoin_protocol.hpp"
+
+namespace bitecoin{
+
+//! How to choose one round parameter. Either one fixed value, or drawn fresh each round.
+struct distribution_t
+{
+	enum kind_t{
+		Fixed,			// value
+		Uniform,		// lo hi, inclusive for integers
+		Exponential,	// min mean max, so min plus an exponential with that mean, capped at max
+		Choice			// a b c ..., each as likely as the others
+	};
+
+	kind_t kind;
+	std::vector<double> args;
+
+	distribution_t(double value=0)
+		: kind(Fixed)
+		, args(1, value)
+	{}
+
+	double DrawReal(std::mt19937_64 &rng) const
+	{
+		switch(kind){
+		case Uniform:
+			return std::uniform_real_distribution<double>(args[0], args[1])(rng);
+		case Exponential:
+			return std::min(args[2], args[0]+std::exponential_distribution<double>(1.0/args[1])(rng));
+		case Choice:
+			return args[std::uniform_int_distribution<size_t>(0, args.size()-1)(rng)];
+		default:
+			return args[0];
+		}
+	}
+
+	uint32_t DrawInt(std::mt19937_64 &rng) const
+	{
+		if(kind==Uniform)
+			return std::uniform_int_distribution<uint32_t>(uint32_t(args[0]), uint32_t(args[1]))(rng);
+		return uint32_t(DrawReal(rng)+0.5);
+	}
+
+	double Min() const
+	{ return kind==Choice ? *std::min_element(args.begin(), args.end()) : args[0]; }
+
+	double Max() const
+	{
+		switch(kind){
+		case Uniform:		return args[1];
+		case Exponential:	return args[2];
+		case Choice:		return *std::max_element(args.begin(), args.end());
+		default:			return args[0];
+		}
+	}
+};
+
+/*! Chooses the parameters and length of each round, for both the server and the exchange.
+	Everything comes from one generator, so the same seed and schedule always give the same
+	sequence of rounds, and different engines can be compared on exactly the same work.
+
+	A schedule file has one setting per line, with # for comments:
+
+		seed 1234
+		hashSteps uniform 16 31
+		maxIndices 16
+		chainSize uniform 16 1015
+		roundLength exponential 0.25 2.75 60
+		c 4294964621 4294967295 3418534911 2138916474
+
+	Each of hashSteps, maxIndices, chainSize and roundLength (seconds) takes a fixed value,
+	"uniform lo hi", "exponential min mean max" or "choice a b ...", and c takes four words
+	or "random". A line "rounds n" ends the current phase after n rounds, and the settings
+	that follow start a new phase which begins as a copy of the one before. The last phase
+	goes on forever. With no file at all, rounds look like the ones above.
+*/
+class RoundSchedule
+{
+private:
+	struct phase_t
+	{
+		unsigned rounds;	// 0 for forever
+		distribution_t hashSteps, maxIndices, chainSize, roundLength;
+		bool randomC;
+		uint32_t c[BIGINT_WORDS/2];
+	};
+
+	uint64_t m_seed;
+	std::mt19937_64 m_rng;
+	std::vector<phase_t> m_phases;
+	unsigned m_phase;		// The phase of the last round begun
+	unsigned m_phaseRounds;	// Rounds begun in that phase
+
+	static phase_t DefaultPhase()
+	{
+		phase_t p;
+		p.rounds=0;
+		p.hashSteps.kind=distribution_t::Uniform;
+		p.hashSteps.args={16, 31};
+		p.maxIndices=distribution_t(16);
+		p.chainSize.kind=distribution_t::Uniform;
+		p.chainSize.args={16, 1015};
+		// Mostly short, but with a long tail
+		p.roundLength.kind=distribution_t::Exponential;
+		p.roundLength.args={0.25, 2.75, 60};
+		// These are just arbitrary values. The real exchange may choose
+		// different ones
+		p.randomC=false;
+		p.c[0]=4294964621;
+		p.c[1]=4294967295;
+		p.c[2]=3418534911;
+		p.c[3]=2138916474;
+		return p;
+	}
+
+	static distribution_t ParseDistribution(std::istringstream &line, const std::string &where)
+	{
+		std::vector<std::string> words;
+		std::string w;
+		while(line>>w){
+			words.push_back(w);
+		}
+		if(words.empty())
+			Throw<std::runtime_error>()<<where<<" - Missing value.";
+
+		distribution_t res;
+		unsigned first=1;
+		if(words[0]=="uniform"){
+			res.kind=distribution_t::Uniform;
+		}else if(words[0]=="exponential"){
+			res.kind=distribution_t::Exponential;
+		}else if(words[0]=="choice"){
+			res.kind=distribution_t::Choice;
+		}else{
+			res.kind=distribution_t::Fixed;
+			first=0;
+		}
+
+		res.args.clear();
+		for(unsigned i=first;i<words.size();i++){
+			char *end=0;
+			double v=strtod(words[i].c_str(), &end);
+			if(*end!=0)
+				Throw<std::runtime_error>()<<where<<" - Couldn't parse '"<<words[i]<<"' as a number.";
+			res.args.push_back(v);
+		}
+
+		size_t want= res.kind==distribution_t::Fixed ? 1 : res.kind==distribution_t::Uniform ? 2 : res.kind==distribution_t::Exponential ? 3 : 0;
+		if(want ? res.args.size()!=want : res.args.empty())
+			Throw<std::runtime_error>()<<where<<" - Wrong number of values for '"<<words[0]<<"'.";
+		if(res.kind==distribution_t::Uniform && res.args[0]>res.args[1])
+			Throw<std::runtime_error>()<<where<<" - Uniform range is backwards.";
+		if(res.kind==distribution_t::Exponential && !(res.args[1]>0 && res.args[0]<=res.args[2]))
+			Throw<std::runtime_error>()<<where<<" - Exponential needs a positive mean and min<=max.";
+		return res;
+	}
+
+	static void CheckRange(const distribution_t &d, double lo, double hi, const char *name)
+	{
+		if(d.Min()<lo || d.Max()>hi)
+			Throw<std::runtime_error>()<<"RoundSchedule - "<<name<<" must stay within ["<<lo<<","<<hi<<"].";
+	}
+public:
+	RoundSchedule(uint64_t seed)
+		: m_seed(seed)
+		, m_rng(seed)
+		, m_phases(1, DefaultPhase())
+		, m_phase(0)
+		, m_phaseRounds(0)
+	{}
+
+	//! Replaces the phases with those in the file. A seed in the file is used unless keepSeed is set.
+	void Load(const std::string &path, bool keepSeed=false)
+	{
+		std::ifstream src(path.c_str());
+		if(!src.is_open())
+			Throw<std::runtime_error>()<<"RoundSchedule - Couldn't open schedule '"<<path<<"'.";
+
+		std::vector<phase_t> phases(1, DefaultPhase());
+		std::string text;
+		unsigned lineNo=0;
+		while(std::getline(src, text)){
+			lineNo++;
+			text=text.substr(0, text.find('#'));
+
+			std::istringstream line(text);
+			std::string key;
+			if(!(line>>key))
+				continue;
+
+			std::string where=path+":"+std::to_string(lineNo);
+			phase_t &p=phases.back();
+			if(key=="seed"){
+				uint64_t seed;
+				if(!(line>>seed))
+					Throw<std::runtime_error>()<<where<<" - Couldn't parse seed.";
+				if(!keepSeed)
+					m_seed=seed;
+			}else if(key=="rounds"){
+				if(!(line>>p.rounds) || p.rounds==0)
+					Throw<std::runtime_error>()<<where<<" - Expected a positive number of rounds.";
+				phases.push_back(p);
+				phases.back().rounds=0;
+			}else if(key=="hashSteps"){
+				p.hashSteps=ParseDistribution(line, where);
+			}else if(key=="maxIndices"){
+				p.maxIndices=ParseDistribution(line, where);
+			}else if(key=="chainSize"){
+				p.chainSize=ParseDistribution(line, where);
+			}else if(key=="roundLength"){
+				p.roundLength=ParseDistribution(line, where);
+			}else if(key=="c"){
+				std::string w;
+				std::vector<uint32_t> words;
+				p.randomC=false;
+				while(line>>w){
+					if(w=="random" && words.empty()){
+						p.randomC=true;
+						break;
+					}
+					words.push_back(uint32_t(strtoul(w.c_str(), 0, 0)));
+				}
+				if(!p.randomC){
+					if(words.size()!=BIGINT_WORDS/2)
+						Throw<std::runtime_error>()<<where<<" - Expected "<<BIGINT_WORDS/2<<" words for c, or 'random'.";
+					std::copy(words.begin(), words.end(), p.c);
+				}
+			}else{
+				Throw<std::runtime_error>()<<where<<" - Unknown setting '"<<key<<"'.";
+			}
+		}
+		for(auto &p : phases){
+			CheckRange(p.hashSteps, 1, 1e6, "hashSteps");
+			CheckRange(p.maxIndices, 1, 1<<16, "maxIndices");
+			CheckRange(p.chainSize, 0, 1<<24, "chainSize");
+			CheckRange(p.roundLength, 0.01, 60, "roundLength");
+		}
+
+		m_phases=phases;
+		m_rng.seed(m_seed);
+		m_phase=0;
+		m_phaseRounds=0;
+	}
+
+	uint64_t Seed() const
+	{ return m_seed; }
+
+	unsigned PhaseCount() const
+	{ return m_phases.size(); }
+
+	//! Parameters for the next round
+	std::shared_ptr<Packet_ServerBeginRound> MakeBeginRound(uint64_t roundId)
+	{
+		phase_t *p=&m_phases[m_phase];
+		if(p->rounds && m_phaseRounds==p->rounds && m_phase+1<m_phases.size()){
+			m_phase++;
+			m_phaseRounds=0;
+			p=&m_phases[m_phase];
+		}
+		m_phaseRounds++;
+
+		auto beginRound=std::make_shared<Packet_ServerBeginRound>();
+		beginRound->roundId=roundId;
+		beginRound->roundSalt=m_rng();
+		beginRound->chainData.assign(p->chainSize.DrawInt(m_rng), 0);
+		beginRound->maxIndices=p->maxIndices.DrawInt(m_rng);
+		for(unsigned i=0;i<BIGINT_WORDS/2;i++){
+			beginRound->c[i]= p->randomC ? uint32_t(m_rng()) : p->c[i];
+		}
+		beginRound->hashSteps=p->hashSteps.DrawInt(m_rng);
+		return beginRound;
+	}
+
+	//! Length in seconds of the round last begun
+	double MakeRoundLength()
+	{
+		double roundLength=m_phases[m_phase].roundLength.DrawReal(m_rng);
+		return std::max(0.01, std::min(60.0, roundLength));
+	}
+};
+
+/*! Takes leading "seed=n" and "schedule=path" arguments off the front of spec, and returns
+	the schedule they describe. Without a seed one is picked at random, and logged so the
+	run can be repeated. */
+std::shared_ptr<RoundSchedule> OpenRoundSchedule(std::vector<std::string> &spec)
+{
+	bool haveSeed=false;
+	uint64_t seed=0;
+	std::string path;
+	while(!spec.empty()){
+		const std::string &arg=spec[0];
+		if(arg.compare(0, 5, "seed=")==0){
+			seed=strtoull(arg.c_str()+5, 0, 0);
+			haveSeed=true;
+		}else if(arg.compare(0, 9, "schedule=")==0){
+			path=arg.substr(9);
+		}else{
+			break;
+		}
+		spec.erase(spec.begin());
+	}
+
+	if(!haveSeed)
+		seed=std::random_device()();
+	auto res=std::make_shared<RoundSchedule>(seed);
+	if(!path.empty())
+		res->Load(path, haveSeed);
+	fprintf(stderr, "Round schedule : seed=%llu, phases=%u%s%s\n", (unsigned long long)res->Seed(), res->PhaseCount(),
+		path.empty() ? "" : ", file=", path.c_str());
+	return res;
+}
+
+}; // bitecoin
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef  bitecoin_scheduler_hpp
+#define  bitecoin_scheduler_hpp
+
+#include <cstdint>
+#include <cmath>
+
+#include <vector>
+#include <memory>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+#include "bitecoin_protocol.hpp"
+#include "bitecoin_hashing.hpp"
+
+namespace bitecoin{
+
+/*! Shares one pool of CPU mining workers between all the rounds that are open at the same
+	time, for example on several exchanges at once. Each worker repeatedly takes a short
+	chunk of trials from one round, chosen as follows:
+	- Rounds about to finish are urgent, and urgent rounds go earliest deadline first, so
+	  nothing is starved right at the end.
+	- Otherwise it goes to the round where another trial is worth the most. The chance of
+	  winning goes roughly as the square root of the number of trials (see ChooseWinner),
+	  so the marginal value of a trial is weight/sqrt(trials). Ties go to the earliest deadline.
+*/
+class MiningScheduler
+{
+public:
+	//! Called with each improvement found for a job, from a worker thread
+	typedef std::function<void(unsigned nIndices, const uint32_t *pIndices, const uint32_t *pProof)> offer_t;
+
+	class Job
+	{
+	private:
+		friend class MiningScheduler;
+
+		std::shared_ptr<const HashContext> context;
+		unsigned maxIndices;
+		double tFinish;	// Our clock, in seconds
+		double weight;
+		offer_t offer;
+
+		// Protected by the scheduler's mutex
+		uint64_t trials;
+		unsigned active;	// Workers currently running a chunk of this job
+		unsigned lastChunk;	// Trials in the last chunk, to guess what active workers will add
+		bool closed;
+
+		std::mutex bestMutex;
+		bigint_t bestProof;
+		std::vector<uint32_t> bestSolution;
+
+		// Returns true if it was an improvement
+		bool Offer(const std::vector<uint32_t> &solution, const bigint_t &proof)
+		{
+			std::lock_guard<std::mutex> lock(bestMutex);
+			if(wide_compare(BIGINT_WORDS, proof.limbs, bestProof.limbs)>=0)
+				return false;
+			bestSolution=solution;
+			bestProof=proof;
+			return true;
+		}
+	public:
+		//! Empty if nothing has been tried yet
+		void GetBest(std::vector<uint32_t> &solution, uint32_t *pProof)
+		{
+			std::lock_guard<std::mutex> lock(bestMutex);
+			solution=bestSolution;
+			wide_copy(BIGINT_WORDS, pProof, bestProof.limbs);
+		}
+	};
+private:
+	MiningScheduler(MiningScheduler &); // = delete;
+	void operator =(const MiningScheduler &); // = delete;
+
+	// Workers come back to choose a job this often
+	enum{ CHUNK_MS = 10 };
+	// Rounds with less than this left are served earliest deadline first
+	enum{ URGENT_MS = 4*CHUNK_MS };
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;	// Signalled when jobs are opened, or workers finish a chunk
+	std::vector<std::shared_ptr<Job> > m_jobs;
+	std::vector<std::thread> m_workers;
+	bool m_quit;
+
+	//! Must hold m_mutex
+	std::shared_ptr<Job> Pick(double t)
+	{
+		std::shared_ptr<Job> best;
+		bool bestUrgent=false;
+		double bestValue=0;
+		for(auto &job : m_jobs){
+			if(job->closed || job->tFinish<=t)
+				continue;
+			bool urgent= job->tFinish-t < URGENT_MS*1e-3;
+			double value=job->weight/sqrt(1.0+job->trials+job->active*double(job->lastChunk));
+
+			bool better;
+			if(!best){
+				better=true;
+			}else if(urgent!=bestUrgent){
+				better=urgent;
+			}else if(urgent || value==bestValue){
+				better= job->tFinish < best->tFinish;
+			}else{
+				better= value > bestValue;
+			}
+			if(better){
+				best=job;
+				bestUrgent=urgent;
+				bestValue=value;
+			}
+		}
+		return best;
+	}
+
+	//! Random trials until the chunk is up, returning how many were done
+	unsigned RunChunk(Job &job, std::minstd_rand &rng, std::vector<uint32_t> &indices, std::vector<uint32_t> &localBest)
+	{
+		double tStop=std::min(job.tFinish, now()*1e-9+CHUNK_MS*1e-3);
+
+		bigint_t bestProof;
+		wide_ones(BIGINT_WORDS, bestProof.limbs);
+
+		unsigned n=0;
+		do{
+			// Same sort of index choice as the default client, always strictly increasing
+			uint32_t curr=0;
+			for(unsigned j=0;j<job.maxIndices;j++){
+				curr=curr+1+(rng()%10);
+				indices[j]=curr;
+			}
+			bigint_t proof=job.context->Hash(job.maxIndices, &indices[0]);
+			if(wide_compare(BIGINT_WORDS, proof.limbs, bestProof.limbs)<0){
+				bestProof=proof;
+				localBest=indices;
+			}
+			n++;
+		}while(now()*1e-9 < tStop);
+
+		// Only the best of the chunk goes any further
+		if(job.Offer(localBest, bestProof) && job.offer)
+			job.offer(job.maxIndices, &localBest[0], bestProof.limbs);
+		return n;
+	}
+
+	void Worker(unsigned id)
+	{
+		std::minstd_rand rng(id*7919+time(0));
+		std::vector<uint32_t> indices, localBest;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while(!m_quit){
+			std::shared_ptr<Job> job=Pick(now()*1e-9);
+			if(!job){
+				// Nothing open, or all past their deadline and waiting to be closed
+				m_cond.wait_for(lock, std::chrono::milliseconds(CHUNK_MS));
+				continue;
+			}
+			job->active++;
+			lock.unlock();
+
+			indices.resize(job->maxIndices);
+			unsigned n=RunChunk(*job, rng, indices, localBest);
+
+			lock.lock();
+			job->trials+=n;
+			job->lastChunk=n;
+			job->active--;
+			m_cond.notify_all();
+		}
+	}
+public:
+	MiningScheduler(unsigned nWorkers=0)
+		: m_quit(false)
+	{
+		if(nWorkers==0)
+			nWorkers=std::max(1u, std::thread::hardware_concurrency());
+		for(unsigned i=0;i<nWorkers;i++){
+			m_workers.push_back(std::thread([this,i](){ Worker(i); }));
+		}
+	}
+
+	~MiningScheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit=true;
+			m_cond.notify_all();
+		}
+		for(auto &w : m_workers){
+			w.join();
+		}
+	}
+
+	unsigned WorkerCount() const
+	{ return m_workers.size(); }
+
+	/*! Start mining a round until tFinish (our clock, seconds). The weight is how much a win
+		on this round is worth relative to the others. */
+	std::shared_ptr<Job> Open(const Packet_ServerBeginRound *pParams, double tFinish, double weight, offer_t offer)
+	{
+		auto job=std::make_shared<Job>();
+		job->context=std::make_shared<HashContext>(pParams);
+		job->maxIndices=pParams->maxIndices;
+		job->tFinish=tFinish;
+		job->weight=weight;
+		job->offer=offer;
+		job->trials=0;
+		job->active=0;
+		job->lastChunk=0;
+		job->closed=false;
+		wide_ones(BIGINT_WORDS, job->bestProof.limbs);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(job);
+		m_cond.notify_all();
+		return job;
+	}
+
+	//! Stop mining the job, and wait for any worker still on it. Returns the number of trials.
+	uint64_t Close(const std::shared_ptr<Job> &job)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		job->closed=true;
+		while(job->active>0){
+			m_cond.wait(lock);
+		}
+		m_jobs.erase(std::remove(m_jobs.begin(), m_jobs.end(), job), m_jobs.end());
+		return job->trials;
+	}
+};
+
+}; // bitecoin
+
+#endif
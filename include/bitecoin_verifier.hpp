@@ -0,0 +1,132 @@
+#ifndef  bitecoin_verifier_hpp
+#define  bitecoin_verifier_hpp
+
+#include <cstdint>
+#include <cstring>
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "tbb/task_group.h"
+#include "tbb/concurrent_vector.h"
+
+#include "bitecoin_protocol.hpp"
+#include "bitecoin_hashing.hpp"
+
+namespace bitecoin{
+
+struct verify_result_t
+{
+	unsigned key;		// Whatever the caller passed to Submit
+	bool valid;
+	std::string error;	// Why it wasn't valid
+	timestamp_t timeRecv;	// When the bid arrived
+	timestamp_t timeVerified;	// When the check finished
+
+	double Latency() const
+	{ return (timeVerified-timeRecv)*1e-9; }
+};
+
+struct latency_summary_t
+{
+	unsigned n;
+	double p50, p90, p99, max;	// In seconds
+};
+
+//! Percentiles of a set of latencies, using the nearest rank
+latency_summary_t SummariseLatency(std::vector<double> latencies)
+{
+	latency_summary_t res={0, 0, 0, 0, 0};
+	res.n=latencies.size();
+	if(latencies.empty())
+		return res;
+	std::sort(latencies.begin(), latencies.end());
+	auto rank=[&](double p){
+		unsigned i=unsigned(ceil(p*latencies.size()));
+		return latencies[std::max(1u, i)-1];
+	};
+	res.p50=rank(0.5);
+	res.p90=rank(0.9);
+	res.p99=rank(0.99);
+	res.max=latencies.back();
+	return res;
+}
+
+/*! Checks bids on the TBB worker threads as soon as they are submitted, so verification
+	overlaps with the rest of the bid window rather than all happening at the end. There
+	is one HashContext per round, shared by all the checks. Submit is only called from one
+	thread, and the results are only looked at once Finish has waited for everything.
+*/
+class SubmissionVerifier
+{
+private:
+	SubmissionVerifier(SubmissionVerifier &); // = delete;
+	void operator =(const SubmissionVerifier &); // = delete;
+
+	std::shared_ptr<const HashContext> m_context;
+	tbb::task_group m_group;
+	tbb::concurrent_vector<verify_result_t> m_results;
+public:
+	SubmissionVerifier()
+	{}
+
+	// The task_group destructor can throw, but nothing we run lets an exception escape
+	~SubmissionVerifier() noexcept
+	{
+		m_group.wait();
+	}
+
+	//! Anything still running from the last round is finished and thrown away
+	void BeginRound(const Packet_ServerBeginRound *pParams)
+	{
+		m_group.wait();
+		m_results.clear();
+		m_context=std::make_shared<HashContext>(pParams);
+	}
+
+	//! Copies what it needs from the submission, so the caller can reuse it straight away
+	void Submit(unsigned key, const submission_t &sub)
+	{
+		if(!m_context)
+			throw std::logic_error("SubmissionVerifier::Submit - No round has begun.");
+
+		std::shared_ptr<const HashContext> context=m_context;
+		std::vector<uint32_t> solution=sub.solution;
+		bigint_t proof;
+		wide_copy(BIGINT_WORDS, proof.limbs, sub.proof);
+		timestamp_t timeRecv=sub.timeRecv;
+
+		m_group.run([=](){
+			verify_result_t res;
+			res.key=key;
+			res.timeRecv=timeRecv;
+			try{
+				bigint_t correct=context->Hash(solution.size(), solution.data());
+				res.valid= 0==memcmp(correct.limbs, proof.limbs, BIGINT_LENGTH);
+				if(!res.valid)
+					res.error="Proof is not correct.";
+			}catch(std::exception &e){
+				res.valid=false;
+				res.error=e.what();
+			}
+			res.timeVerified=now();
+			m_results.push_back(res);
+		});
+	}
+
+	//! Wait for every submission this round, and return the results in order of key
+	std::vector<verify_result_t> Finish()
+	{
+		m_group.wait();
+		std::vector<verify_result_t> res(m_results.begin(), m_results.end());
+		std::sort(res.begin(), res.end(), [](const verify_result_t &a, const verify_result_t &b){
+			return a.key < b.key;
+		});
+		return res;
+	}
+};
+
+}; // bitecoin
+
+#endif
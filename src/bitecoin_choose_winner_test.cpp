@@ -0,0 +1,72 @@
+#include "bitecoin_hashing.hpp"
+
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <vector>
+
+/*! Checks that ChooseWinner picks each submission with probability sqrt(1/score)/sum, by
+	drawing many winners and doing a chi-squared test on how often each group of
+	submissions won. One round is small enough for the serial loop, and one is big enough
+	for the parallel path. The seeds are fixed, so it passes or fails the same every time.
+*/
+
+using namespace bitecoin;
+
+// Submissions are split into this many groups, with group g about (g+1)^2 times as likely to win as group 0
+enum{ GROUPS = 10 };
+
+// Chi-squared with GROUPS-1=9 degrees of freedom, at p=0.001
+const double CHI2_LIMIT=27.88;
+
+static bool CheckRound(unsigned n, unsigned trials, unsigned seed)
+{
+	std::mt19937 gen(seed);
+
+	// Scores go in the top limbs, like real proofs, with some noise so no two are the same
+	std::vector<bigint_t> choices(n);
+	std::vector<double> expected(GROUPS, 0.0);
+	double total=0;
+	for(unsigned i=0;i<n;i++){
+		unsigned g=i%GROUPS;
+		bigint_t &b=choices[i];
+		wide_zero(BIGINT_WORDS, b.limbs);
+		b.limbs[BIGINT_WORDS-1]=(0xFFFFFFFFu/((g+1)*(g+1)*(g+1)*(g+1))) - (gen()%1024);
+		b.limbs[BIGINT_WORDS-2]=gen();
+
+		double w=sqrt(1.0 / wide_as_double(BIGINT_WORDS, b.limbs));
+		expected[g]+=w;
+		total+=w;
+	}
+
+	std::mt19937 rng(seed+1);
+	std::vector<double> observed(GROUPS, 0.0);
+	for(unsigned t=0;t<trials;t++){
+		unsigned winner=ChooseWinner(choices, rng);
+		if(winner>=n){
+			fprintf(stderr, "n=%u : ChooseWinner returned %u, which is out of range.\n", n, winner);
+			return false;
+		}
+		observed[winner%GROUPS]++;
+	}
+
+	double chi2=0;
+	for(unsigned g=0;g<GROUPS;g++){
+		double e=trials*expected[g]/total;
+		chi2+=(observed[g]-e)*(observed[g]-e)/e;
+		fprintf(stderr, "  group %u : expected %.4f, observed %.4f\n", g, expected[g]/total, observed[g]/trials);
+	}
+	bool ok= chi2 < CHI2_LIMIT;
+	fprintf(stderr, "n=%u, trials=%u : chi2=%.2f (limit %.2f) %s\n", n, trials, chi2, CHI2_LIMIT, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+int main()
+{
+	bool ok=true;
+	// Below the parallel cutoff in ChooseWinner, so this is the serial loop
+	ok = CheckRound(1000, 200000, 1) && ok;
+	// Above it, so parallel_for and parallel_scan
+	ok = CheckRound(40000, 5000, 2) && ok;
+	return ok ? 0 : 1;
+}
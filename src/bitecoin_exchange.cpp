@@ -0,0 +1,42 @@
+#include "bitecoin_protocol.hpp"
+#include "bitecoin_endpoint_exchange.hpp"
+
+#include <iostream>
+
+int main(int argc, char *argv[])
+{
+	if(argc<4){
+		fprintf(stderr, "bitecoin_exchange exchange_id logLevel [seed=n] [schedule=path] (tcp-server port | unix-server path)\n");
+		exit(1);
+	}
+	
+	try{
+		std::string exchangeId=argv[1];
+		std::string serverId="David's Exchange";
+		
+		int logLevel=atoi(argv[2]);
+		
+		std::vector<std::string> spec;
+		for(int i=3;i<argc;i++){
+			spec.push_back(argv[i]);
+		}
+		
+		bitecoin::detail::RaiseFileLimit();
+		
+		auto schedule=bitecoin::OpenRoundSchedule(spec);
+		bitecoin::EndpointExchange exchange(exchangeId, serverId, spec, logLevel, schedule);
+		exchange.Run();
+
+	}catch(std::string &msg){
+		std::cerr<<"Caught error string : "<<msg<<std::endl;
+		return 1;
+	}catch(std::exception &e){
+		std::cerr<<"Caught exception : "<<e.what()<<std::endl;
+		return 1;
+	}catch(...){
+		std::cerr<<"Caught unknown exception."<<std::endl;
+		return 1;
+	}
+	
+	return 0;
+}
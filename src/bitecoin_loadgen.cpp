@@ -0,0 +1,592 @@
+#include "bitecoin_protocol.hpp"
+#include "bitecoin_log.hpp"
+#include "bitecoin_hashing.hpp"
+#include "bitecoin_verifier.hpp"
+
+#include <iostream>
+#include <map>
+#include <queue>
+#include <random>
+
+#include <csignal>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace bitecoin{
+
+struct loadgen_params_t
+{
+	unsigned nClients;
+	double bidAt;		// When the final bid goes, as a fraction of the bid period
+	double spread;		// Final bids are spread uniformly over this fraction of the period, centred on bidAt
+	unsigned improve;	// Improved bids sent by each client before its final one
+	unsigned solutions;	// Distinct valid solutions worked out per round, shared out between the clients
+	unsigned rounds;	// Stop after this many rounds, or 0 to go forever
+	unsigned seed;
+};
+
+/*! Lots of fake clients in one thread, for loading up an exchange. Everything is one epoll
+	loop plus a queue of timers for when bids are due, so thousands of clients don't need
+	thousands of threads, and the load generator stays much cheaper than the exchange.
+
+	The clients don't mine. Each round a handful of valid solutions are hashed once, and
+	the clients take turns submitting them, so the exchange still has to verify every bid
+	and choose between them. Results are decoded with the flat decoder, as with N clients
+	each one holds N submissions.
+
+	Each round logs how long after the last final bid went the results arrived, which is
+	when the exchange can close the round, so it covers the exchange's verification tail,
+	ChooseWinner and the broadcast. It also logs the gap before the next round starts.
+	Set the exchange's log level to 2 to see its side of the same rounds.
+*/
+class LoadGenerator
+{
+private:
+	LoadGenerator(LoadGenerator &); // = delete;
+	void operator =(const LoadGenerator &); // = delete;
+
+	struct fake_t
+	{
+		int fd;
+		unsigned id;
+		bool wantWrite;
+		uint64_t roundId;	// Of the last BeginRound, or 0
+		bool hasResults;	// For that round
+		uint32_t serverProtocol;	// From ServerCompleteConnect
+		std::vector<uint8_t> recvBuffer;
+		std::vector<uint8_t> sendBuffer;
+		size_t sendBegin;
+	};
+
+	struct round_t
+	{
+		std::shared_ptr<Packet_ServerBeginRound> params;
+		std::vector<std::vector<uint32_t> > solutions;
+		std::vector<bigint_t> proofs;
+		timestamp_t tBegin;		// When the first client heard about it
+		timestamp_t tLastFinal;	// When the last final bid was sent
+		double period;	// Or 0 until a client has the request
+		unsigned nClients, nBids, nResults, nSubmissions;
+		std::vector<double> resultLatency;	// Seconds after the last final bid
+	};
+
+	struct bid_timer_t
+	{
+		timestamp_t due;
+		unsigned client;
+		uint64_t roundId;
+		unsigned bid;	// Which of the client's bids, where the last is the final one
+
+		bool operator<(const bid_timer_t &o) const
+		{ return due > o.due; }	// So the priority queue gives the earliest first
+	};
+
+	std::shared_ptr<ILog> m_log;
+	loadgen_params_t m_params;
+	std::mt19937 m_rng;
+	int m_epoll;
+	std::vector<fake_t> m_fakes;
+	std::map<int,unsigned> m_byFd;
+	std::map<uint64_t,round_t> m_rounds;
+	std::priority_queue<bid_timer_t> m_timers;
+
+	// Totals across the whole run
+	timestamp_t m_tStart;
+	uint64_t m_bidsSent, m_bytesRecv;
+	unsigned m_roundsDone, m_dropped;
+	timestamp_t m_tLastResults;	// When the first results of the last round arrived
+
+	detail::ConnectionOverMemory m_encoder;
+	PacketPool m_recvPool;
+	std::vector<uint8_t> m_readChunk;
+	Packet_ClientSendBid m_finalBid;
+	Packet_ClientImproveBid m_improveBid;
+
+	static int OpenSocket(const std::vector<std::string> &spec)
+	{
+		int sock=-1;
+		if(spec.size()==3 && spec[0]=="tcp-client"){
+			struct addrinfo hints, *result;
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family=AF_UNSPEC;
+			hints.ai_socktype=SOCK_STREAM;
+			hints.ai_protocol=IPPROTO_TCP;
+			int e=getaddrinfo(spec[1].c_str(), spec[2].c_str(), &hints, &result);
+			if(e!=0)
+				Throw<std::runtime_error>()<<"LoadGenerator - Resolving '"<<spec[1]<<"', got err="<<gai_strerror(e);
+			for(struct addrinfo *curr=result;curr;curr=curr->ai_next){
+				sock=socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
+				if(sock==-1){
+					e=errno;
+					continue;
+				}
+				if(connect(sock, curr->ai_addr, curr->ai_addrlen)==0)
+					break;
+				e=errno;
+				close(sock);
+				sock=-1;
+			}
+			freeaddrinfo(result);
+			if(sock==-1)
+				Throw<std::runtime_error>()<<"LoadGenerator - Couldn't connect, errno="<<e;
+			detail::SetNoDelay(sock);
+		}else if(spec.size()==2 && spec[0]=="unix-client"){
+			struct sockaddr_un addr;
+			detail::MakeUnixAddr(spec[1], addr);
+			sock=socket(AF_UNIX, SOCK_STREAM, 0);
+			if(sock==-1)
+				Throw<std::runtime_error>()<<"LoadGenerator - Couldn't create socket, errno="<<errno;
+			if(connect(sock, (struct sockaddr *)&addr, sizeof(addr))!=0){
+				int e=errno;
+				close(sock);
+				Throw<std::runtime_error>()<<"LoadGenerator - Couldn't connect, errno="<<e;
+			}
+		}else{
+			throw std::invalid_argument("LoadGenerator - Spec should be 'tcp-client host port' or 'unix-client path'.");
+		}
+
+		int flags=fcntl(sock, F_GETFL, 0);
+		if(flags==-1 || fcntl(sock, F_SETFL, flags|O_NONBLOCK)==-1){
+			close(sock);
+			Throw<std::runtime_error>()<<"LoadGenerator - Couldn't make socket non-blocking, errno="<<errno;
+		}
+		return sock;
+	}
+
+	void Watch(const fake_t &fake, uint32_t events, int op)
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events=events;
+		ev.data.fd=fake.fd;
+		if(epoll_ctl(m_epoll, op, fake.fd, &ev)!=0)
+			Throw<std::runtime_error>()<<"LoadGenerator - epoll_ctl failed, errno="<<errno;
+	}
+
+	void Drop(fake_t &fake, const char *reason)
+	{
+		if(fake.fd==-1)
+			return;
+		m_log->Log(Log_Error, "Dropping client %u : %s", fake.id, reason);
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, fake.fd, NULL);
+		close(fake.fd);
+		m_byFd.erase(fake.fd);
+		fake.fd=-1;
+		m_dropped++;
+
+		// Don't leave its round waiting for results that will never come
+		auto it=m_rounds.find(fake.roundId);
+		if(it!=m_rounds.end() && !fake.hasResults){
+			it->second.nClients--;
+			MaybeFinishRound(it);
+		}
+	}
+
+	void WriteFake(fake_t &fake)
+	{
+		while(fake.sendBegin < fake.sendBuffer.size()){
+			ssize_t done=send(fake.fd, &fake.sendBuffer[fake.sendBegin], fake.sendBuffer.size()-fake.sendBegin, MSG_NOSIGNAL);
+			if(done<0){
+				if(errno==EAGAIN || errno==EWOULDBLOCK)
+					break;
+				if(errno==EINTR)
+					continue;
+				Throw<std::runtime_error>()<<"send failed, errno="<<errno;
+			}
+			fake.sendBegin+=done;
+		}
+
+		bool pending=fake.sendBegin < fake.sendBuffer.size();
+		if(!pending){
+			fake.sendBuffer.clear();
+			fake.sendBegin=0;
+		}
+		if(pending!=fake.wantWrite){
+			Watch(fake, pending ? (EPOLLIN|EPOLLOUT) : EPOLLIN, EPOLL_CTL_MOD);
+			fake.wantWrite=pending;
+		}
+	}
+
+	void Queue(fake_t &fake, const Packet &packet)
+	{
+		m_encoder.ClearSent();
+		packet.Send(&m_encoder);
+		const std::vector<uint8_t> &bytes=m_encoder.Sent();
+		fake.sendBuffer.insert(fake.sendBuffer.end(), bytes.begin(), bytes.end());
+		if(!fake.wantWrite)
+			WriteFake(fake);
+	}
+
+	//! Work out this round's solutions the first time any client sees it
+	round_t &BeginRound(const std::shared_ptr<Packet_ServerBeginRound> &params)
+	{
+		auto it=m_rounds.find(params->roundId);
+		if(it!=m_rounds.end())
+			return it->second;
+
+		round_t &r=m_rounds[params->roundId];
+		// Holding on to it stops the pool reusing it
+		r.params=params;
+		r.tBegin=now();
+		r.tLastFinal=0;
+		r.period=0;
+		r.nClients=0;
+		r.nBids=0;
+		r.nResults=0;
+		r.nSubmissions=0;
+
+		HashContext context(r.params.get());
+		unsigned n=std::max(1u, std::min(m_params.solutions, m_params.nClients));
+		r.solutions.resize(n);
+		r.proofs.resize(n);
+		for(unsigned i=0;i<n;i++){
+			std::vector<uint32_t> &sol=r.solutions[i];
+			sol.resize(r.params->maxIndices);
+			uint32_t curr=0;
+			for(unsigned j=0;j<sol.size();j++){
+				curr=curr+1+(m_rng()%10);
+				sol[j]=curr;
+			}
+			r.proofs[i]=context.Hash(sol.size(), &sol[0]);
+		}
+
+		if(m_tLastResults){
+			m_log->Log(Log_Verbose, "Round %llu began %.3lf ms after the last round's first results.",
+				(unsigned long long)params->roundId, (int64_t(r.tBegin)-int64_t(m_tLastResults))*1e-6);
+		}
+		m_log->Log(Log_Verbose, "Round %llu : maxIndices=%u, hashSteps=%u, %u solutions took %.3lf ms.",
+			(unsigned long long)params->roundId, r.params->maxIndices, r.params->hashSteps, n, (now()-r.tBegin)*1e-6);
+		return r;
+	}
+
+	void MaybeFinishRound(std::map<uint64_t,round_t>::iterator it)
+	{
+		round_t &r=it->second;
+		if(r.nResults<r.nClients)
+			return;
+
+		latency_summary_t lat=SummariseLatency(r.resultLatency);
+		m_log->Log(Log_Info, "Round %llu : clients=%u, bids=%u, submissions=%u, results after last bid (ms) p50=%.3lf, p90=%.3lf, p99=%.3lf, max=%.3lf",
+			(unsigned long long)it->first, r.nClients, r.nBids, r.nSubmissions, lat.p50*1e3, lat.p90*1e3, lat.p99*1e3, lat.max*1e3
+		);
+		m_roundsDone++;
+		m_rounds.erase(it);
+	}
+
+	void OnRequestBid(fake_t &fake, const Packet_ServerRequestBid &request)
+	{
+		auto it=m_rounds.find(fake.roundId);
+		if(it==m_rounds.end())
+			return;
+		round_t &r=it->second;
+		if(r.period==0){
+			r.period=(request.timeStampReceiveBids-request.timeStampRequestBids)*1e-9;
+		}
+
+		// Improved bids evenly spaced up to bidAt, if the exchange takes them, and the final one spread around it
+		double tStart=request.timeStampRequestBids*1e-9;
+		unsigned nImprove= fake.serverProtocol>=ProtocolVersion_StreamBids ? m_params.improve : 0;
+		for(unsigned i=0;i<nImprove;i++){
+			bid_timer_t t;
+			t.due=timestamp_t((tStart + r.period*m_params.bidAt*(i+1)/(m_params.improve+1))*1e9);
+			t.client=fake.id;
+			t.roundId=fake.roundId;
+			t.bid=i;
+			m_timers.push(t);
+		}
+		double at=m_params.bidAt+m_params.spread*(std::uniform_real_distribution<double>(0,1)(m_rng)-0.5);
+		bid_timer_t t;
+		t.due=timestamp_t((tStart + r.period*std::max(0.0, at))*1e9);
+		t.client=fake.id;
+		t.roundId=fake.roundId;
+		t.bid=m_params.improve;
+		m_timers.push(t);
+	}
+
+	void OnTimer(const bid_timer_t &t)
+	{
+		fake_t &fake=m_fakes[t.client];
+		auto it=m_rounds.find(t.roundId);
+		if(fake.fd==-1 || fake.roundId!=t.roundId || it==m_rounds.end())
+			return;
+		round_t &r=it->second;
+
+		bool isFinal= t.bid==m_params.improve;
+		Packet_ClientSendBid &bid= isFinal ? m_finalBid : m_improveBid;
+		unsigned k=(fake.id+t.bid)%r.solutions.size();
+		bid.roundId=t.roundId;
+		bid.solution=r.solutions[k];
+		wide_copy(BIGINT_WORDS, bid.proof, r.proofs[k].limbs);
+		bid.timeSent=now();
+		Queue(fake, bid);
+
+		m_bidsSent++;
+		if(isFinal){
+			r.nBids++;
+			r.tLastFinal=bid.timeSent;
+		}
+	}
+
+	void HandlePacket(fake_t &fake, const std::shared_ptr<Packet> &packet)
+	{
+		if(auto complete=std::dynamic_pointer_cast<Packet_ServerCompleteConnect>(packet)){
+			fake.serverProtocol=complete->protocolVersion;
+			if(m_params.improve>0 && fake.serverProtocol<ProtocolVersion_StreamBids)
+				m_log->Log(Log_Info, "Client %u : exchange doesn't take improved bids, so only sending final ones.", fake.id);
+			m_log->Log(Log_Debug, "Client %u connected.", fake.id);
+		}else if(auto begin=std::dynamic_pointer_cast<Packet_ServerBeginRound>(packet)){
+			round_t &r=BeginRound(begin);
+			r.nClients++;
+			fake.roundId=begin->roundId;
+			fake.hasResults=false;
+		}else if(auto request=std::dynamic_pointer_cast<Packet_ServerRequestBid>(packet)){
+			OnRequestBid(fake, *request);
+		}else if(auto results=std::dynamic_pointer_cast<Packet_ServerCompleteRoundFlat>(packet)){
+			auto it=m_rounds.find(results->RoundId());
+			if(it==m_rounds.end())
+				return;
+			round_t &r=it->second;
+			fake.hasResults=true;
+			if(r.nResults++==0)
+				m_tLastResults=now();
+			r.nSubmissions=std::max(r.nSubmissions, results->SubmissionCount());
+			if(r.tLastFinal)
+				r.resultLatency.push_back((int64_t(now())-int64_t(r.tLastFinal))*1e-9);
+			MaybeFinishRound(it);
+		}else if(auto err=std::dynamic_pointer_cast<Packet_ServerError>(packet)){
+			throw std::runtime_error("Exchange sent error : "+err->errorMessage);
+		}else{
+			Throw<std::runtime_error>()<<"Unexpected packet "<<CommandName(packet->CommandId());
+		}
+	}
+
+	void ReadFake(fake_t &fake)
+	{
+		while(1){
+			ssize_t done=recv(fake.fd, &m_readChunk[0], m_readChunk.size(), 0);
+			if(done==0)
+				throw std::runtime_error("Exchange closed connection.");
+			if(done<0){
+				if(errno==EAGAIN || errno==EWOULDBLOCK)
+					return;
+				if(errno==EINTR)
+					continue;
+				Throw<std::runtime_error>()<<"recv failed, errno="<<errno;
+			}
+			m_bytesRecv+=done;
+
+			std::vector<uint8_t> &buffer=fake.recvBuffer;
+			buffer.insert(buffer.end(), &m_readChunk[0], &m_readChunk[done]);
+			size_t begin=0;
+			while(buffer.size()-begin >= 8){
+				const uint32_t *pWords=(const uint32_t*)&buffer[begin];
+				uint64_t length=(uint64_t(ntohl(pWords[0]))<<32) | ntohl(pWords[1]);
+				if(length<20)
+					Throw<std::runtime_error>()<<"Received packet with bad length "<<length;
+				if(buffer.size()-begin < length)
+					break;
+
+				detail::ConnectionOverMemory decoder;
+				decoder.SetRecvData(length, &buffer[begin]);
+				auto packet=Packet::Recv(&decoder, &m_recvPool);
+				begin+=length;
+
+				HandlePacket(fake, packet);
+			}
+			buffer.erase(buffer.begin(), buffer.begin()+begin);
+		}
+	}
+
+	void Poll(int timeoutMs)
+	{
+		struct epoll_event events[256];
+		int n=epoll_wait(m_epoll, events, 256, timeoutMs);
+		if(n<0){
+			if(errno==EINTR)
+				return;
+			Throw<std::runtime_error>()<<"LoadGenerator - epoll_wait failed, errno="<<errno;
+		}
+
+		for(int i=0;i<n;i++){
+			auto it=m_byFd.find(events[i].data.fd);
+			if(it==m_byFd.end())
+				continue;
+			fake_t &fake=m_fakes[it->second];
+			try{
+				if(events[i].events & EPOLLOUT)
+					WriteFake(fake);
+				if(events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+					ReadFake(fake);
+			}catch(std::exception &e){
+				Drop(fake, e.what());
+			}
+		}
+	}
+public:
+	LoadGenerator(
+			std::shared_ptr<ILog> log,
+			const loadgen_params_t &params
+		)
+		: m_log(log)
+		, m_params(params)
+		, m_rng(params.seed)
+		, m_epoll(-1)
+		, m_tStart(0)
+		, m_bidsSent(0)
+		, m_bytesRecv(0)
+		, m_roundsDone(0)
+		, m_dropped(0)
+		, m_tLastResults(0)
+		, m_readChunk(1<<16)
+	{
+		m_recvPool.SetFlatCompleteRound(true);
+		m_epoll=epoll_create1(0);
+		if(m_epoll==-1)
+			Throw<std::runtime_error>()<<"LoadGenerator - Couldn't create epoll instance, errno="<<errno;
+	}
+
+	~LoadGenerator()
+	{
+		for(auto &fake : m_fakes){
+			if(fake.fd!=-1)
+				close(fake.fd);
+		}
+		close(m_epoll);
+	}
+
+	//! Connect every client, one after the other
+	void Connect(const std::string &prefix, const std::vector<std::string> &spec)
+	{
+		m_fakes.resize(m_params.nClients);
+		for(unsigned i=0;i<m_params.nClients;i++){
+			fake_t &fake=m_fakes[i];
+			fake.fd=OpenSocket(spec);
+			fake.id=i;
+			fake.wantWrite=false;
+			fake.roundId=0;
+			fake.hasResults=false;
+			fake.serverProtocol=ProtocolVersion_Basic;
+			fake.sendBegin=0;
+			m_byFd[fake.fd]=i;
+			Watch(fake, EPOLLIN, EPOLL_CTL_ADD);
+
+			Packet_ClientBeginConnect connect(prefix+"-"+std::to_string(i), "Load Generator");
+			connect.protocolVersion=ProtocolVersion_Ping;
+			Queue(fake, connect);
+		}
+		m_log->Log(Log_Info, "Connected %u clients.", m_params.nClients);
+	}
+
+	void Run()
+	{
+		m_tStart=now();
+		while(m_params.rounds==0 || m_roundsDone<m_params.rounds){
+			if(m_byFd.empty())
+				throw std::runtime_error("LoadGenerator - All clients have gone.");
+
+			int timeoutMs=-1;
+			while(!m_timers.empty()){
+				timestamp_t t=now();
+				if(m_timers.top().due > t){
+					timeoutMs=int((m_timers.top().due-t+999999)/1000000);
+					break;
+				}
+				bid_timer_t timer=m_timers.top();
+				m_timers.pop();
+				try{
+					OnTimer(timer);
+				}catch(std::exception &e){
+					Drop(m_fakes[timer.client], e.what());
+				}
+			}
+			Poll(timeoutMs);
+		}
+
+		double elapsed=(now()-m_tStart)*1e-9;
+		m_log->Log(Log_Info, "Finished %u rounds in %.3lf secs : %.3lf rounds/sec, %.1lf bids/sec, %.3lf MB/sec of results, %u clients dropped.",
+			m_roundsDone, elapsed, m_roundsDone/elapsed, m_bidsSent/elapsed, m_bytesRecv/elapsed/1e6, m_dropped
+		);
+	}
+};
+
+}; // bitecoin
+
+int main(int argc, char *argv[])
+{
+	if(argc<5){
+		fprintf(stderr, "bitecoin_loadgen client_prefix logLevel nClients [bidAt=f] [spread=f] [improve=n] [solutions=n] [rounds=n] [seed=n] (tcp-client host port | unix-client path)\n");
+		fprintf(stderr, "  bidAt is when the final bid goes as a fraction of the period (default 0.5), spread how widely\n");
+		fprintf(stderr, "  the clients are spread around it (default 0.2), and improve the number of improved bids before it.\n");
+		exit(1);
+	}
+
+	// We handle errors at the point of read/write
+	signal(SIGPIPE, SIG_IGN);	// Just look at error codes
+
+	try{
+		std::string prefix=argv[1];
+		int logLevel=atoi(argv[2]);
+
+		bitecoin::loadgen_params_t params;
+		params.nClients=atoi(argv[3]);
+		params.bidAt=0.5;
+		params.spread=0.2;
+		params.improve=0;
+		params.solutions=16;
+		params.rounds=0;
+		params.seed=time(0);
+		if(params.nClients==0)
+			throw std::invalid_argument("Need at least one client.");
+
+		int i=4;
+		for(;i<argc;i++){
+			std::string arg=argv[i];
+			size_t eq=arg.find('=');
+			if(eq==std::string::npos)
+				break;
+			std::string name=arg.substr(0, eq);
+			const char *value=argv[i]+eq+1;
+			if(name=="bidAt"){
+				params.bidAt=strtod(value, 0);
+			}else if(name=="spread"){
+				params.spread=strtod(value, 0);
+			}else if(name=="improve"){
+				params.improve=atoi(value);
+			}else if(name=="solutions"){
+				params.solutions=atoi(value);
+			}else if(name=="rounds"){
+				params.rounds=atoi(value);
+			}else if(name=="seed"){
+				params.seed=atoi(value);
+			}else{
+				throw std::invalid_argument("Unknown option '"+arg+"'.");
+			}
+		}
+		std::vector<std::string> spec(argv+i, argv+argc);
+
+		bitecoin::detail::RaiseFileLimit();
+
+		std::shared_ptr<bitecoin::ILog> log=std::make_shared<bitecoin::LogDest>(prefix, logLevel);
+		bitecoin::LoadGenerator gen(log, params);
+		gen.Connect(prefix, spec);
+		gen.Run();
+	}catch(std::string &msg){
+		std::cerr<<"Caught error string : "<<msg<<std::endl;
+		return 1;
+	}catch(std::exception &e){
+		std::cerr<<"Caught exception : "<<e.what()<<std::endl;
+		return 1;
+	}catch(...){
+		std::cerr<<"Caught unknown exception."<<std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -20,6 +20,14 @@
 
 #include <fstream>
 #include <streambuf>
+#include <sstream>
+#include <map>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include "tbb/parallel_for.h"
 
 // Update: this doesn't work in windows - if necessary take it out. It is in
 // here because some unix platforms complained if it wasn't heere.
@@ -32,10 +40,75 @@
 
 #define worst pow(2.0, BIGINT_LENGTH*8)
 
+// Each side of the miner aims to hand back a chunk of results this often (seconds)
+#define CHUNK_TIME 0.05
+// Upper bound on the trials per OpenCL launch, which sizes the buffers
+#define MAX_CL_ITERATIONS 16384
+// Longest time the work size tuner may take out of a round (seconds)
+#define TUNE_TIME 1.0
+
 namespace bitecoin{
 
 	class EndpointClientV1: public EndpointClient
 	{
+		private:
+			// Work sizes for one device, by maxIndices
+			struct ClProfile
+			{
+				unsigned localY;		// Trials per work group (the x dimension is always maxIndices)
+				unsigned iterations;	// Trials per launch
+				double rate;			// Trials per second seen when it was tuned
+			};
+			
+			/* The buffers for one launch. Each device has two, so that the next launch can be
+				filled in and queued while the previous one is running.
+				The buffers are allocated with CL_MEM_ALLOC_HOST_PTR and accessed by mapping them,
+				which on CPU and integrated devices is just a pointer into the same memory rather
+				than a staging copy. Each slot has its own queue, as a map on a shared in-order
+				queue would have to wait for the other slot's kernel. */
+			struct ClSlot
+			{
+				cl::CommandQueue queue;
+				cl::Buffer buffIndices, buffPoint;
+				unsigned capacity;		// Trials the buffers have room for, zero before the first launch
+				uint32_t *indices, *point;	// Mapped for reading once the launch is queued
+				std::vector<bigint_t> proof;
+				cl::Event done;
+				unsigned iterations;	// Trials in flight, zero if idle
+			};
+			
+			struct ClSlotPair
+			{
+				ClSlot slots[2];
+			};
+			
+			// Everything that is kept per OpenCL device. Each device is driven by its own thread.
+			struct ClDevice
+			{
+				cl::Device device;
+				cl::Context context;	// Shared with the other devices on the same platform
+				cl::CommandQueue queue;
+				std::string name;
+				
+				// Kernels specialised for a particular (hashSteps, maxIndices), built on first use
+				std::map<std::pair<uint32_t,uint32_t>, cl::Kernel> kernels;
+				
+				bool profilesLoaded;
+				std::map<uint32_t, ClProfile> profiles;
+				
+				// Launch buffers by maxIndices, idle between rounds. They are sized from the
+				// tuned iterations, so only grow past that while tuning.
+				std::map<uint32_t, ClSlotPair> slots;
+				cl_ulong maxAlloc;	// CL_DEVICE_MAX_MEM_ALLOC_SIZE
+				
+				bool failed;	// Threw during a round, so it is left out of later ones
+			};
+		
+			// OpenCL state is set up on the first round and then kept for the life of the client
+			bool m_clReady, m_clFailed;
+			std::vector<std::shared_ptr<ClDevice> > m_clDevices;
+			std::string m_kernelSource;
+			
 		public:
 			EndpointClientV1(
 				std::string clientId,
@@ -43,6 +116,8 @@ namespace bitecoin{
 				std::unique_ptr<Connection> &conn,
 				std::shared_ptr<ILog> &log
 			): EndpointClient (clientId, minerId, conn, log)
+			, m_clReady(false)
+			, m_clFailed(false)
 			{}
 			
 		std::string LoadSource(const char *fileName)
@@ -64,193 +139,699 @@ namespace bitecoin{
 			std::istreambuf_iterator<char>()
 		    );
 		}
+		
+		// Is index i picked by a comma separated list in the environment? Unset means everything.
+		bool IsSelected(const char *var, unsigned i)
+		{
+			if(!getenv(var))
+				return true;
+			std::stringstream acc(getenv(var));
+			std::string item;
+			while(std::getline(acc, item, ',')){
+				if(!item.empty() && unsigned(atoi(item.c_str()))==i)
+					return true;
+			}
+			return false;
+		}
+		
+		void InitOpenCL()
+		{
+			if(m_clReady)
+				return;
 			
-		void MakeBid(
-			const std::shared_ptr<Packet_ServerBeginRound> roundInfo,	// Information about this particular round
-			const std::shared_ptr<Packet_ServerRequestBid> request,		// The specific request we received
-			double period,																			// How long this bidding period will last
-			double skewEstimate,																// An estimate of the time difference between us and the server (positive -> we are ahead)
-			std::vector<uint32_t> &solution,												// Our vector of indices describing the solution
-			uint32_t *pProof																		// Will contain the "proof", which is just the value
-		){
-			try{
-				// Time Related Calculations
-				double tSafetyMargin=0.2;
-				double tFinish=request->timeStampReceiveBids*1e-9 + skewEstimate - tSafetyMargin;
-				Log(Log_Verbose, "MakeBid - start, total period=%lg.", period);
-				double Trialt = now()*1e-9;
-				
-				// Best Score
-				std::vector<uint32_t> bestSolution(roundInfo->maxIndices);
-				bigint_t bestProof;
-				wide_ones(BIGINT_WORDS, bestProof.limbs);
-				
-				// Generation of Point for hashing
-				hash::fnv<64> hasher;
-				uint64_t chainHash=hasher((const char*)&roundInfo.get()->chainData[0], roundInfo.get()->chainData.size());
-				uint32_t temp[8];
-				temp[0] = 0;
-				temp[1] = 0;
-				temp[2] = roundInfo.get()->roundId&0xFFFFFFFFULL;
-				temp[3] = temp[2];
-				temp[4] = roundInfo.get()->roundSalt&0xFFFFFFFFULL;
-				temp[5] = temp[4];
-				temp[6] = chainHash&0xFFFFFFFFULL;
-				temp[7] = temp[6];
-				
-				unsigned nTrials=0;
-				
-				// Initialise OpenCL
-				std::vector<cl::Platform> platforms;
+			std::vector<cl::Platform> platforms;
 
-				cl::Platform::get(&platforms);
-				if(platforms.size()==0)
-				throw std::runtime_error("No OpenCL platforms found.");
+			cl::Platform::get(&platforms);
+			if(platforms.size()==0)
+			throw std::runtime_error("No OpenCL platforms found.");
 
-				std::cerr<<"Found "<<platforms.size()<<" platforms\n";
-				for(unsigned i=0;i<platforms.size();i++){
-					std::string vendor=platforms[i].getInfo<CL_PLATFORM_VENDOR>();
-					std::cerr<<" Platform "<<i<<" : "<<vendor<<"\n";
-				}
-
-				int selectedPlatform=0;
-				if(getenv("HPCE_SELECT_PLATFORM")){
-					selectedPlatform=atoi(getenv("HPCE_SELECT_PLATFORM"));
-				}
-				std::cerr<<"Choosing platform "<<selectedPlatform<<"\n";
-				cl::Platform platform=platforms.at(selectedPlatform);
+			std::cerr<<"Found "<<platforms.size()<<" platforms\n";
+			for(unsigned i=0;i<platforms.size();i++){
+				std::string vendor=platforms[i].getInfo<CL_PLATFORM_VENDOR>();
+				std::cerr<<" Platform "<<i<<" : "<<vendor<<"\n";
+			}
 
+			// HPCE_SELECT_PLATFORM and HPCE_SELECT_DEVICE take comma separated lists,
+			// by default every device on every platform is used
+			for(unsigned p=0;p<platforms.size();p++){
+				if(!IsSelected("HPCE_SELECT_PLATFORM", p))
+					continue;
+				std::cerr<<"Choosing platform "<<p<<"\n";
+				
 				std::vector<cl::Device> devices;
-				platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);	
-				if(devices.size()==0){
-					throw std::runtime_error("No opencl devices found.\n");
+				try{
+					platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &devices);	
+				}catch(const cl::Error &){
+					// Platforms with no devices report CL_DEVICE_NOT_FOUND
 				}
-
+				
 				std::cerr<<"Found "<<devices.size()<<" devices\n";
+				std::vector<cl::Device> selected;
 				for(unsigned i=0;i<devices.size();i++){
 					std::string name=devices[i].getInfo<CL_DEVICE_NAME>();
 					std::cerr<<" Device "<<i<<" : "<<name<<"\n";
+					if(IsSelected("HPCE_SELECT_DEVICE", i)){
+						std::cerr<<"Choosing device "<<i<<"\n";
+						selected.push_back(devices[i]);
+					}
 				}
+				if(selected.size()==0)
+					continue;
 
-				int selectedDevice=0;
-				if(getenv("HPCE_SELECT_DEVICE")){
-					selectedDevice=atoi(getenv("HPCE_SELECT_DEVICE"));
+				cl::Context context(selected);
+				for(unsigned i=0;i<selected.size();i++){
+					auto dev=std::make_shared<ClDevice>();
+					dev->device=selected[i];
+					dev->context=context;
+					dev->queue=cl::CommandQueue(context, selected[i]);
+					dev->name=selected[i].getInfo<CL_DEVICE_NAME>();
+					dev->profilesLoaded=false;
+					dev->maxAlloc=selected[i].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+					dev->failed=false;
+					m_clDevices.push_back(dev);
 				}
-				std::cerr<<"Choosing device "<<selectedDevice<<"\n";
-				cl::Device device=devices.at(selectedDevice);
-
-				cl::Context context(devices);
-
-				std::string kernelSource=LoadSource("bitecoin_miner_kernel.cl");
+			}
+			if(m_clDevices.size()==0){
+				throw std::runtime_error("No opencl devices found.\n");
+			}
 
-				cl::Program::Sources sources;
-				sources.push_back(std::make_pair(kernelSource.c_str(), kernelSource.size()+1)); // push on our single string
+			m_kernelSource=LoadSource("bitecoin_miner_kernel.cl");
+			
+			m_clReady=true;
+		}
 		
-				cl::Program program(context, sources);
-				try{
-				    program.build(devices);
-				}catch(...){
-				    for(unsigned i=0;i<devices.size();i++){
-					std::cerr<<"Log for device "<<devices[i].getInfo<CL_DEVICE_NAME>()<<":\n\n";
-					std::cerr<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[i])<<"\n\n";
-				    }
-				    throw;
+		/* Returns the kernel compiled with hashSteps and maxIndices baked in as constants,
+			building (and caching) it the first time a pair is seen on this device. */
+		cl::Kernel &GetKernel(ClDevice &dev, uint32_t hashSteps, uint32_t maxIndices)
+		{
+			auto key=std::make_pair(hashSteps, maxIndices);
+			auto it=dev.kernels.find(key);
+			if(it!=dev.kernels.end())
+				return it->second;
+			
+			double tStart=now()*1e-9;
+			
+			cl::Program::Sources sources;
+			sources.push_back(std::make_pair(m_kernelSource.c_str(), m_kernelSource.size()+1)); // push on our single string
+			
+			std::stringstream options;
+			options<<"-D HASH_STEPS="<<hashSteps<<" -D MAX_INDICES="<<maxIndices;
+			
+			std::vector<cl::Device> buildDevices(1, dev.device);
+			cl::Program program(dev.context, sources);
+			try{
+			    program.build(buildDevices, options.str().c_str());
+			}catch(...){
+				std::cerr<<"Log for device "<<dev.name<<" ("<<options.str()<<"):\n\n";
+				std::cerr<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev.device)<<"\n\n";
+			    throw;
+			}
+			
+			cl::Kernel &kernel=dev.kernels[key];
+			kernel=cl::Kernel(program, "main_loop");
+			
+			Log(Log_Verbose, "Built kernel on %s for hashSteps=%u, maxIndices=%u in %lg seconds.", dev.name.c_str(), hashSteps, maxIndices, now()*1e-9-tStart);
+			return kernel;
+		}
+			
+		/* Best solution found so far in this round. Both the OpenCL side and the CPU side
+			offer their candidates here, so it is protected by a mutex. Each side only offers
+			the best from a whole chunk, so it is taken rarely. */
+		struct SharedBest
+		{
+			std::mutex mutex;
+			std::vector<uint32_t> solution;
+			bigint_t proof;
+			
+			SharedBest(unsigned maxIndices)
+				: solution(maxIndices)
+			{ wide_ones(BIGINT_WORDS, proof.limbs); }
+			
+			bool Offer(const uint32_t *indices, const bigint_t &candidate)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if(wide_compare(BIGINT_WORDS, candidate.limbs, proof.limbs)>=0)
+					return false;
+				std::copy(indices, indices+solution.size(), solution.begin());
+				proof=candidate;
+				return true;
+			}
+		};
+		
+		/* Tracks the measured throughput of one side of the miner and sizes its next chunk
+			from it, so each side hands back roughly every tChunk seconds and neither runs
+			far past the deadline. */
+		struct ChunkSizer
+		{
+			double rate;	// Smoothed trials per second, zero until the first chunk is timed
+			unsigned granularity, minChunk, maxChunk, firstChunk;
+			
+			ChunkSizer(unsigned _granularity, unsigned _minChunk, unsigned _maxChunk, unsigned _firstChunk)
+				: rate(0)
+				, granularity(_granularity)
+				, minChunk(_minChunk)
+				, maxChunk(_maxChunk)
+				, firstChunk(_firstChunk)
+			{}
+				
+			void Update(unsigned trials, double seconds)
+			{
+				if(seconds<=0)
+					return;
+				double r=trials/seconds;
+				rate = rate==0 ? r : 0.7*rate+0.3*r;
+			}
+			
+			unsigned Next(double tChunk, double tRemaining)
+			{
+				if(rate==0)
+					return firstChunk;
+				double want=rate*std::min(tChunk, std::max(tRemaining, 0.0));
+				unsigned n=unsigned(std::min(want, double(maxChunk)));
+				n=(n/granularity)*granularity;
+				return std::max(minChunk, std::min(maxChunk, n));
+			}
+		};
+		
+		// Round up the values which are the same for every point in this round
+		void MakeTemp(const Packet_ServerBeginRound *roundInfo, uint32_t *temp)
+		{
+			hash::fnv<64> hasher;
+			uint64_t chainHash=hasher((const char*)&roundInfo->chainData[0], roundInfo->chainData.size());
+			temp[0] = 0;
+			temp[1] = 0;
+			temp[2] = roundInfo->roundId&0xFFFFFFFFULL;
+			temp[3] = temp[2];
+			temp[4] = roundInfo->roundSalt&0xFFFFFFFFULL;
+			temp[5] = temp[4];
+			temp[6] = chainHash&0xFFFFFFFFULL;
+			temp[7] = temp[6];
+		}
+		
+		// CPU version of one trial, the same as the kernel plus the host-side xor
+		static void HashTrial(const Packet_ServerBeginRound *roundInfo, const uint32_t *temp, const uint32_t *indices, bigint_t &proof)
+		{
+			wide_zero(8, proof.limbs);
+			for (unsigned int i=0; i<roundInfo->maxIndices; i++){
+				uint32_t point[8], tmp[8];
+				point[0] = indices[i];
+				for (unsigned x = 1; x < 8; x++){
+					point[x] = temp[x];
+				}
+				for(unsigned y=0;y<roundInfo->hashSteps;y++){
+					wide_mul(4, &tmp[4], &tmp[0], &point[0], roundInfo->c);
+					uint32_t carry=wide_add(4, &point[0], &tmp[0], &point[4]);
+					wide_add(4, &point[4], &tmp[4], carry);
 				}
+				wide_xor(8, proof.limbs, proof.limbs, point);
+			}
+		}
+		
+		/* Runs on its own thread for the whole round, spreading chunks of trials over
+			the cores with TBB. rand() isn't safe to share, so each trial draws its indices
+			from its own generator. */
+		void MineCpu(const Packet_ServerBeginRound *roundInfo, const uint32_t *temp, double tFinish, SharedBest &best, unsigned &nTrials)
+		{
+			const unsigned maxIndices=roundInfo->maxIndices;
+			ChunkSizer sizer(64, 64, 1<<20, 64);
+			std::vector<uint32_t> indices;
+			std::vector<bigint_t> proof;
+			
+			while(1){
+				double tStart=now()*1e-9;
+				if(tFinish <= tStart)
+					break;
 				
-				cl::Kernel kernel(program, "main_loop");
+				unsigned chunk=sizer.Next(CHUNK_TIME, tFinish-tStart);
+				indices.resize(chunk*maxIndices);
+				proof.resize(chunk);
+				uint32_t seed=rand();
 				
-				uint32_t maxcompunits = devices[selectedDevice].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-				uint32_t maxworkgroupsize = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(devices[selectedDevice]);
+				tbb::parallel_for(0u, chunk, [&](unsigned k){
+					std::minstd_rand rng(seed+k);
+					uint32_t *curr=&indices[k*maxIndices];
+					curr[0]=1+(rng()%10);
+					for(unsigned i=1;i<maxIndices;i++){
+						curr[i]=curr[i-1]+1+(rng()%10);
+					}
+					HashTrial(roundInfo, temp, curr, proof[k]);
+				});
 				
-				// Variables
-				unsigned int iterations = 1536;
-				uint32_t *indices;
-				indices = new uint32_t[iterations*roundInfo->maxIndices];
-				bigint_t *proof;
-				proof = new bigint_t[iterations];
-				uint32_t *point;
-				point = new uint32_t[iterations*roundInfo->maxIndices*8];
-				double score[iterations];
+				unsigned bestK=0;
+				for(unsigned k=1;k<chunk;k++){
+					if(wide_compare(BIGINT_WORDS, proof[k].limbs, proof[bestK].limbs)<0)
+						bestK=k;
+				}
+				if(best.Offer(&indices[bestK*maxIndices], proof[bestK])){
+					double score=wide_as_double(BIGINT_WORDS, proof[bestK].limbs);
+					Log(Log_Verbose, "    CPU found new best, nTrials=%d, score=%lg, ratio=%lg.", nTrials + bestK, score, worst/score);
+					OfferBid(maxIndices, &indices[bestK*maxIndices], proof[bestK].limbs);
+				}
 				
-				//allocating GPU buffers
-				cl::Buffer buffPoint(context, CL_MEM_WRITE_ONLY, roundInfo->maxIndices*iterations*8*4);
-				cl::Buffer buffIndices(context, CL_MEM_READ_ONLY, 4*iterations*roundInfo->maxIndices);
-				cl::Buffer buffC(context, CL_MEM_READ_ONLY, 4*4);
-				cl::Buffer buffTemp(context, CL_MEM_READ_ONLY, 8*4);
+				nTrials += chunk;
+				sizer.Update(chunk, now()*1e-9-tStart);
+				Log(Log_Debug, "CPU chunk of %u trials, rate=%lg.", chunk, sizer.rate);
+			}
+		}
+		
+		std::string ProfilePath(ClDevice &dev)
+		{
+			std::string baseDir=".";
+			if(getenv("HPCE_CL_PROFILE_DIR")){
+				baseDir=getenv("HPCE_CL_PROFILE_DIR");
+			}
+			
+			std::string name=dev.name+"_"+dev.device.getInfo<CL_DRIVER_VERSION>();
+			for(unsigned i=0;i<name.size();i++){
+				if(!isalnum(name[i]))
+					name[i]='_';
+			}
+			return baseDir+"/bitecoin_cl_profile_"+name+".txt";
+		}
+		
+		// Lines are "maxIndices localY iterations rate", anything after a '#' is ignored
+		void LoadProfiles(ClDevice &dev)
+		{
+			std::ifstream src(ProfilePath(dev));
+			std::string line;
+			while(std::getline(src, line)){
+				line=line.substr(0, line.find('#'));
+				std::stringstream acc(line);
+				uint32_t maxIndices;
+				ClProfile profile;
+				if(acc>>maxIndices>>profile.localY>>profile.iterations>>profile.rate && profile.localY>0){
+					// The buffers are only ever MAX_CL_ITERATIONS big
+					profile.iterations=std::min(profile.iterations, (unsigned)MAX_CL_ITERATIONS);
+					profile.iterations=std::max(profile.localY, (profile.iterations/profile.localY)*profile.localY);
+					dev.profiles[maxIndices]=profile;
+				}
+			}
+			Log(Log_Verbose, "Loaded %u work size profiles from %s.", (unsigned)dev.profiles.size(), ProfilePath(dev).c_str());
+		}
+		
+		// Written to a temporary file and renamed over the old one, so another device (or
+		// another client) tuning at the same time never reads a half written file
+		void SaveProfiles(ClDevice &dev)
+		{
+			std::string path=ProfilePath(dev);
+			std::string tmpPath=path+".tmp."+std::to_string(getpid())+"."+std::to_string((uintptr_t)&dev);
+			{
+				std::ofstream dst(tmpPath);
+				if(!dst.is_open()){
+					Log(Log_Error, "Couldn't write work size profile to %s.", tmpPath.c_str());
+					return;
+				}
+				dst<<"# OpenCL work size profile for "<<dev.name<<"\n";
+				dst<<"# maxIndices localY iterations rate\n";
+				for(auto it=dev.profiles.begin(); it!=dev.profiles.end(); ++it){
+					dst<<it->first<<" "<<it->second.localY<<" "<<it->second.iterations<<" "<<it->second.rate<<"\n";
+				}
+				dst.close();
+				if(dst.fail()){
+					Log(Log_Error, "Couldn't write work size profile to %s.", tmpPath.c_str());
+					unlink(tmpPath.c_str());
+					return;
+				}
+			}
+			if(rename(tmpPath.c_str(), path.c_str())!=0){
+				int e=errno;
+				Log(Log_Error, "Couldn't move work size profile to %s, errno=%d.", path.c_str(), e);
+				unlink(tmpPath.c_str());
+			}
+		}
+		
+		// Most trials one launch can do, either from MAX_CL_ITERATIONS or the biggest buffer the device allows
+		unsigned MaxTrials(ClDevice &dev, unsigned maxIndices)
+		{
+			cl_ulong perTrial=cl_ulong(maxIndices)*8*4;	// The points are the bigger buffer
+			return unsigned(std::min<cl_ulong>(MAX_CL_ITERATIONS, dev.maxAlloc/perTrial));
+		}
+		
+		// Makes sure the slot's buffers hold at least trials, creating its queue the first time
+		void SizeSlot(ClDevice &dev, ClSlot &slot, unsigned maxIndices, unsigned trials)
+		{
+			if(slot.capacity>=trials)
+				return;
+			if(slot.capacity==0)
+				slot.queue=cl::CommandQueue(dev.context, dev.device);
+			slot.buffIndices=cl::Buffer(dev.context, CL_MEM_READ_ONLY|CL_MEM_ALLOC_HOST_PTR, 4*trials*maxIndices);
+			slot.buffPoint=cl::Buffer(dev.context, CL_MEM_WRITE_ONLY|CL_MEM_ALLOC_HOST_PTR, maxIndices*trials*8*4);
+			slot.proof.resize(trials);
+			slot.capacity=trials;
+		}
+		
+		/* The OpenCL side of the round for one device, runs on that device's thread. Returns
+			false without mining if the device can't run a work group of maxIndices. */
+		bool MineOpenCL(ClDevice &dev, const Packet_ServerBeginRound *roundInfo, const uint32_t *temp, double tFinish, SharedBest &best, unsigned &nTrials)
+		{
+			cl::Kernel &kernel=GetKernel(dev, roundInfo->hashSteps, roundInfo->maxIndices);
+			
+			// Variables
+			const unsigned maxIndices=roundInfo->maxIndices;
+			// Nothing is allocated until the first launch, which is after GetProfile has
+			// checked the work group fits
+			auto inserted=dev.slots.insert(std::make_pair(maxIndices, ClSlotPair()));
+			ClSlot *slots=inserted.first->second.slots;
+			if(inserted.second){
+				for(unsigned s=0;s<2;s++){
+					slots[s].capacity=0;
+					slots[s].indices=NULL;
+					slots[s].point=NULL;
+					slots[s].iterations=0;
+				}
+			}
+			
+			//allocating GPU buffers
+			cl::Buffer buffC(dev.context, CL_MEM_READ_ONLY, 4*4);
+			cl::Buffer buffTemp(dev.context, CL_MEM_READ_ONLY, 8*4);
 
-				//Setting the Kernel Params  --> can bring outside for loop?
-				kernel.setArg(0, roundInfo.get()->hashSteps);
-				kernel.setArg(1, buffC);
-				kernel.setArg(2, buffIndices);
-				kernel.setArg(3, buffPoint);
-				kernel.setArg(4, buffTemp);	
-				kernel.setArg(5, 4*roundInfo->maxIndices*4, NULL);	
-			
-				//creating command queue for single device
-				cl::CommandQueue queue(context, device);
+			//Setting the Kernel Params
+			kernel.setArg(0, roundInfo->hashSteps);
+			kernel.setArg(1, buffC);
+			kernel.setArg(4, buffTemp);	
 
-				//Setting up the iteration space
-				cl::NDRange offset(0, 0);               // Always start iterations at x=0, y=0
-				cl::NDRange globalSize(roundInfo->maxIndices, iterations);   // Global size must match the original loops
-				cl::NDRange localSize(roundInfo->maxIndices, 4);
+			cl::NDRange offset(0, 0);               // Always start iterations at x=0, y=0
+		
+			dev.queue.enqueueWriteBuffer(buffTemp, CL_TRUE, 0, 8*4, &temp[0]);
+			dev.queue.enqueueWriteBuffer(buffC, CL_TRUE, 0, 4*4, &roundInfo->c[0]);
 			
-				queue.enqueueWriteBuffer(buffTemp, CL_TRUE, 0, 8*4, &temp[0]);
-				
+			// rand() takes a lock, and there may be several of these threads
+			std::minstd_rand rng(rand());
+			
+			// Fill in a slot and queue its launch, without waiting for the launch
+			auto submit=[&](ClSlot &slot, unsigned iterations, unsigned localY){
+				Log(Log_Debug, "%s: trials %d - %d.", dev.name.c_str(), nTrials, nTrials + iterations - 1);
+				SizeSlot(dev, slot, maxIndices, iterations);
 				
-				while(1){		// Trial Loop
-					nTrials = nTrials + iterations;
-					Log(Log_Debug, "Trials %d - %d.", nTrials, nTrials + iterations - 1);
-			
-					for(unsigned int k = 0; k < iterations; k++) {
-						indices[(k*roundInfo->maxIndices)]=1+(rand()%10);
-						for(unsigned i=1;i<roundInfo->maxIndices;i++){
-							indices[i+(k*roundInfo->maxIndices)] = indices[i-1+(k*roundInfo->maxIndices)]+1+(rand()%10);
-						}
-						wide_zero(8, proof[k].limbs);
+				// Only waits for this slot's own queue, which is idle by now
+				uint32_t *indices=(uint32_t*)slot.queue.enqueueMapBuffer(slot.buffIndices, CL_TRUE, CL_MAP_WRITE, 0, 4*iterations*maxIndices);
+				for(unsigned int k = 0; k < iterations; k++) {
+					indices[(k*maxIndices)]=1+(rng()%10);
+					for(unsigned i=1;i<maxIndices;i++){
+						indices[i+(k*maxIndices)] = indices[i-1+(k*maxIndices)]+1+(rng()%10);
 					}
+				}
 				
-						queue.enqueueWriteBuffer(buffC, CL_TRUE, 0, 4*4, &roundInfo.get()->c[0]);
-						queue.enqueueWriteBuffer(buffIndices, CL_TRUE, 0, 4*iterations*roundInfo->maxIndices, &indices[0]);
-						queue.enqueueNDRangeKernel(kernel, offset, globalSize, localSize);
-						queue.enqueueBarrier();
-						queue.enqueueReadBuffer(buffPoint, CL_TRUE, 0, roundInfo->maxIndices*iterations*8*4, &point[0]);
+				// Global size must match the original loops
+				cl::NDRange globalSize(maxIndices, iterations);
+				cl::NDRange localSize(maxIndices, localY);
 				
-					for (unsigned k = 0; k < iterations; k++){
-						for (unsigned i = 0; i < roundInfo->maxIndices; i++){
-							for(unsigned x=0;x<8;x++){
-								proof[k].limbs[x] = proof[k].limbs[x]^point[(k*roundInfo->maxIndices+i)*8 + x];
-							}
-						}
-					}
-		
-					for (unsigned k = 0; k < iterations; k++) {
-						score[k]=wide_as_double(BIGINT_WORDS, proof[k].limbs);
-						Log(Log_Debug, "    Score=%lg", score);
-						if(wide_compare(BIGINT_WORDS, proof[k].limbs, bestProof.limbs)<0){
-							Log(Log_Verbose, "    Found new best, nTrials=%d, score=%lg, ratio=%lg.", nTrials + k, score[k], worst/score[k]);
-							for(unsigned i = 0; i < roundInfo->maxIndices; i++){
-								bestSolution[i]=indices[k*roundInfo->maxIndices + i];
-							}
-							bestProof=proof[k];
+				kernel.setArg(2, slot.buffIndices);
+				kernel.setArg(3, slot.buffPoint);
+				slot.queue.enqueueUnmapMemObject(slot.buffIndices, indices);
+				slot.queue.enqueueNDRangeKernel(kernel, offset, globalSize, localSize);
+				// Map both back for the host once the kernel is done, the queue is in order
+				slot.indices=(uint32_t*)slot.queue.enqueueMapBuffer(slot.buffIndices, CL_FALSE, CL_MAP_READ, 0, 4*iterations*maxIndices);
+				slot.point=(uint32_t*)slot.queue.enqueueMapBuffer(slot.buffPoint, CL_FALSE, CL_MAP_READ, 0, maxIndices*iterations*8*4, NULL, &slot.done);
+				slot.queue.flush();
+				slot.iterations=iterations;
+			};
+			
+			// Wait for a slot to come back and fold its results into the best
+			auto collect=[&](ClSlot &slot){
+				slot.done.wait();
+				
+				unsigned iterations=slot.iterations;
+				const uint32_t *indices=slot.indices, *point=slot.point;
+				bigint_t *proof=&slot.proof[0];
+				unsigned bestK=0;
+				for (unsigned k = 0; k < iterations; k++){
+					wide_zero(8, proof[k].limbs);
+					for (unsigned i = 0; i < maxIndices; i++){
+						for(unsigned x=0;x<8;x++){
+							proof[k].limbs[x] = proof[k].limbs[x]^point[(k*maxIndices+i)*8 + x];
 						}
-
 					}
+					if(wide_compare(BIGINT_WORDS, proof[k].limbs, proof[bestK].limbs)<0)
+						bestK=k;
+				}
+	
+				if(best.Offer(&indices[bestK*maxIndices], proof[bestK])){
+					double score=wide_as_double(BIGINT_WORDS, proof[bestK].limbs);
+					Log(Log_Verbose, "    %s found new best, nTrials=%d, score=%lg, ratio=%lg.", dev.name.c_str(), nTrials + bestK, score, worst/score);
+					OfferBid(maxIndices, &indices[bestK*maxIndices], proof[bestK].limbs);
+				}
+				
+				nTrials += iterations;
+				
+				slot.queue.enqueueUnmapMemObject(slot.buffIndices, slot.indices);
+				slot.queue.enqueueUnmapMemObject(slot.buffPoint, slot.point);
+				slot.indices=NULL;
+				slot.point=NULL;
+				slot.iterations=0;
+			};
 			
-					if (tFinish <= now()*1e-9)
-						break;
+			// A single unpipelined launch, used while tuning
+			auto launch=[&](unsigned iterations, unsigned localY){
+				submit(slots[0], iterations, localY);
+				collect(slots[0]);
+			};
+			
+			ClProfile profile=GetProfile(dev, kernel, maxIndices, tFinish, launch);
+			if(profile.localY==0)
+				return false;
+			// Tuning may have tried bigger launches than it settled on, so give that back
+			for(unsigned s=0;s<2;s++){
+				if(slots[s].capacity>profile.iterations){
+					slots[s].buffIndices=cl::Buffer();
+					slots[s].buffPoint=cl::Buffer();
+					slots[s].capacity=0;
+				}
+				SizeSlot(dev, slots[s], maxIndices, profile.iterations);
+			}
+			
+			/* Keep one launch queued behind the one that is running. The sizer sees the
+				time between completions, and the time left is reduced by whatever is
+				already in flight. */
+			ChunkSizer sizer(profile.localY, profile.localY, profile.iterations, profile.iterations);
+			unsigned curr=0;
+			double tLast=now()*1e-9;
+			if(tFinish > tLast)
+				submit(slots[curr], sizer.Next(CHUNK_TIME, tFinish-tLast), profile.localY);
+			while(slots[curr].iterations){		// Trial Loop
+				double tNow=now()*1e-9;
+				double inFlight= sizer.rate>0 ? slots[curr].iterations/sizer.rate : 0;
+				if(tFinish-tNow > inFlight){
+					submit(slots[1-curr], sizer.Next(CHUNK_TIME, tFinish-tNow-inFlight), profile.localY);
 				}
 				
-				Trialt = now()*1e-9 - Trialt;
+				unsigned iterations=slots[curr].iterations;
+				collect(slots[curr]);
+				tNow=now()*1e-9;
+				sizer.Update(iterations, tNow-tLast);
+				tLast=tNow;
 				
-				solution=bestSolution;
-				wide_copy(BIGINT_WORDS, pProof, bestProof.limbs);
+				curr=1-curr;
+			}
+			// The unmaps have to finish before the buffers are used again next round
+			for(unsigned s=0;s<2;s++){
+				slots[s].queue.finish();
+			}
+			return true;
+		}
 		
-				Log(Log_Verbose, "MakeBid - finish.");
-				Log(Log_Verbose, "nTrials=%d, period=%lg, Trial rate=%f trials per second", nTrials, period, nTrials/Trialt);
+		/* Returns the work sizes to use for this device and maxIndices. The first time a
+			maxIndices is seen (and there is nothing in the profile file) it benchmarks a grid
+			of local and global sizes and saves the fastest. The benchmark launches are real
+			trials for the current round, so their results still go into the bid.
+			Work groups are maxIndices by localY, so only localY that fit in both the kernel's
+			and the device's maximum work group size are tried, and saved profiles that don't
+			fit are tuned again. If not even localY=1 fits, the profile has localY=0 and the
+			device sits the round out. */
+		template<class TLaunch>
+		ClProfile GetProfile(ClDevice &dev, cl::Kernel &kernel, unsigned maxIndices, double tFinish, TLaunch &launch)
+		{
+			if(!dev.profilesLoaded){
+				if(!(getenv("HPCE_CL_RETUNE") && atoi(getenv("HPCE_CL_RETUNE"))))
+					LoadProfiles(dev);
+				dev.profilesLoaded=true;
+			}
+			
+			size_t maxworkgroupsize = std::min(
+				kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(dev.device),
+				dev.device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()
+			);
+			std::vector<size_t> maxitemsizes = dev.device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+			size_t maxlocalY = maxitemsizes.size()>1 ? maxitemsizes[1] : 1;
+			unsigned maxtrials = MaxTrials(dev, maxIndices);
+			auto fits=[&](unsigned localY){
+				return maxitemsizes.size()>0 && maxIndices<=maxitemsizes[0] && localY<=maxlocalY
+					&& localY*size_t(maxIndices)<=maxworkgroupsize && localY<=maxtrials;
+			};
 			
-			}catch(const std::exception &e){
-				std::cerr<<"Caught exception : "<<e.what()<<std::endl;
+			ClProfile bestProfile;
+			if(!fits(1)){
+				Log(Log_Error, "%s can't run a work group of maxIndices=%u (max work group %u, max trials per launch %u), using the CPU for this round.",
+					dev.name.c_str(), maxIndices, (unsigned)maxworkgroupsize, maxtrials);
+				bestProfile.localY=0;
+				bestProfile.iterations=0;
+				bestProfile.rate=0;
+				return bestProfile;
+			}
+			
+			auto it=dev.profiles.find(maxIndices);
+			if(it!=dev.profiles.end()){
+				if(fits(it->second.localY)){
+					// The buffers might be smaller on this device than where it was tuned
+					ClProfile &profile=it->second;
+					if(profile.iterations>maxtrials)
+						profile.iterations=(maxtrials/profile.localY)*profile.localY;
+					return profile;
+				}
+				Log(Log_Info, "Saved profile for %s with maxIndices=%u has localY=%u, which doesn't fit, tuning again.",
+					dev.name.c_str(), maxIndices, it->second.localY);
+				dev.profiles.erase(it);
+			}
+			
+			uint32_t maxcompunits = dev.device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+			uint32_t preferredmultiple = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(dev.device);
+			Log(Log_Info, "Tuning work sizes on %s for maxIndices=%u: %u compute units, max work group %u, preferred multiple %u.",
+				dev.name.c_str(), maxIndices, maxcompunits, (unsigned)maxworkgroupsize, preferredmultiple);
+			
+			bestProfile.localY=1;
+			bestProfile.iterations=std::max(1u, std::min(maxcompunits, maxtrials));
+			bestProfile.rate=0;
+			
+			// Don't let tuning eat more than this much of the round
+			double tStop=std::min(tFinish, now()*1e-9+TUNE_TIME);
+			bool cutShort=false;
+			
+			for(unsigned localY=1; fits(localY); localY*=2){
+				// Start at one work group per compute unit, then keep doubling
+				for(unsigned iterations=maxcompunits*localY; iterations<=maxtrials; iterations*=2){
+					if(tStop <= now()*1e-9){
+						cutShort=true;
+						break;
+					}
+					
+					launch(iterations, localY);	// warm up
+					double tStart=now()*1e-9;
+					launch(iterations, localY);
+					launch(iterations, localY);
+					double rate=2*iterations/(now()*1e-9-tStart);
+					Log(Log_Verbose, "    localY=%u, iterations=%u : %lg trials per second.", localY, iterations, rate);
+					
+					if(rate > bestProfile.rate){
+						bestProfile.localY=localY;
+						bestProfile.iterations=iterations;
+						bestProfile.rate=rate;
+					}else if(rate < 0.9*bestProfile.rate){
+						break;	// Past the knee for this local size
+					}
+				}
+			}
+			
+			Log(Log_Info, "Tuned %s for maxIndices=%u to localY=%u, iterations=%u, rate=%lg.", dev.name.c_str(), maxIndices, bestProfile.localY, bestProfile.iterations, bestProfile.rate);
+			
+			// Only write it out if the grid wasn't cut short by the time limit
+			dev.profiles[maxIndices]=bestProfile;
+			if(!cutShort)
+				SaveProfiles(dev);
+			return bestProfile;
+		}
+		
+		// Measured from pings when the server answers them, otherwise a guess which can be
+		// smaller when streamed bids are already at the server
+		virtual double SafetyMargin() const override
+		{ return DeadlineMargin(StreamingBids() ? 0.02 : 0.2); }
+		
+		void MakeBid(
+			const std::shared_ptr<Packet_ServerBeginRound> roundInfo,	// Information about this particular round
+			const std::shared_ptr<Packet_ServerRequestBid> request,		// The specific request we received
+			double period,																			// How long this bidding period will last
+			double skewEstimate,																// An estimate of the time difference between us and the server (positive -> we are ahead)
+			std::vector<uint32_t> &solution,												// Our vector of indices describing the solution
+			uint32_t *pProof																		// Will contain the "proof", which is just the value
+		){
+			// Time Related Calculations
+			double tSafetyMargin= SafetyMargin();
+			double tFinish=request->timeStampReceiveBids*1e-9 + skewEstimate - tSafetyMargin;
+			Log(Log_Verbose, "MakeBid - start, total period=%lg.", period);
+			double Trialt = now()*1e-9;
+			
+			// Best Score
+			SharedBest best(roundInfo->maxIndices);
+			
+			// Generation of Point for hashing
+			uint32_t temp[8];
+			MakeTemp(roundInfo.get(), temp);
+			
+			bool useOpenCL=!m_clFailed && !(getenv("HPCE_USE_OPENCL") && atoi(getenv("HPCE_USE_OPENCL"))==0);
+			if(useOpenCL){
+				try{
+					InitOpenCL();
+				}catch(const std::exception &e){
+					Log(Log_Error, "Couldn't set up OpenCL (%s), mining on the CPU only.", e.what());
+					m_clFailed=true;
+					useOpenCL=false;
+				}
+			}
+			if(useOpenCL){
+				bool anyLeft=false;
+				for(unsigned d=0;d<m_clDevices.size();d++){
+					anyLeft = anyLeft || !m_clDevices[d]->failed;
+				}
+				if(!anyLeft){
+					Log(Log_Error, "Every OpenCL device has failed, mining on the CPU only.");
+					m_clFailed=true;
+					useOpenCL=false;
+				}
+			}
+			// The CPU always mines if there is no OpenCL device to feed
+			bool useCpu=!useOpenCL || !(getenv("HPCE_USE_CPU") && atoi(getenv("HPCE_USE_CPU"))==0);
+			
+			unsigned nTrialsCpu=0;
+			std::thread cpuThread;
+			// Set once something is mining on the CPU, so a device that can't take this
+			// round's work groups, or fails part way, only falls back to the CPU if nothing
+			// else has
+			std::atomic<bool> cpuMining(useCpu);
+			if(useCpu){
+				cpuThread=std::thread([&](){
+					MineCpu(roundInfo.get(), temp, tFinish, best, nTrialsCpu);
+				});
+			}
+			
+			// One thread per OpenCL device, all sharing the same best
+			unsigned nDevices= useOpenCL ? m_clDevices.size() : 0;
+			std::vector<unsigned> nTrialsCl(nDevices, 0);
+			std::vector<std::thread> clThreads;
+			for(unsigned d=0;d<nDevices;d++){
+				if(m_clDevices[d]->failed)
+					continue;
+				clThreads.push_back(std::thread([&,d](){
+					ClDevice &dev=*m_clDevices[d];
+					bool mined=false;
+					try{
+						mined=MineOpenCL(dev, roundInfo.get(), temp, tFinish, best, nTrialsCl[d]);
+					}catch(const std::exception &e){
+						Log(Log_Error, "OpenCL failed on %s (%s), leaving it out from now on.", dev.name.c_str(), e.what());
+						dev.failed=true;
+					}
+					if(!mined && !cpuMining.exchange(true))
+						MineCpu(roundInfo.get(), temp, tFinish, best, nTrialsCpu);
+				}));
+			}
+			
+			for(unsigned t=0;t<clThreads.size();t++){
+				clThreads[t].join();
+			}
+			if(useCpu)
+				cpuThread.join();
+			
+			Trialt = now()*1e-9 - Trialt;
+			
+			std::lock_guard<std::mutex> lock(best.mutex);
+			solution=best.solution;
+			wide_copy(BIGINT_WORDS, pProof, best.proof.limbs);
+	
+			unsigned nTrials=nTrialsCpu;
+			for(unsigned d=0;d<nDevices;d++){
+				Log(Log_Verbose, "  %s : %d trials.", m_clDevices[d]->name.c_str(), nTrialsCl[d]);
+				nTrials += nTrialsCl[d];
 			}
+			Log(Log_Verbose, "MakeBid - finish.");
+			Log(Log_Verbose, "nTrials=%d (CPU %d), period=%lg, Trial rate=%f trials per second", nTrials, nTrialsCpu, period, nTrials/Trialt);
 		}
 	};  // EndpointClient_V1
 
@@ -0,0 +1,168 @@
+#include "bitecoin_protocol.hpp"
+#include "bitecoin_endpoint_client.hpp"
+#include "bitecoin_scheduler.hpp"
+
+#include <iostream>
+#include <thread>
+
+#include <csignal>
+
+namespace bitecoin{
+
+/*! A client that doesn't mine by itself. Each round is handed to the scheduler, which
+	shares one set of workers between every exchange this process is talking to. */
+class EndpointClientShared
+	: public EndpointClient
+{
+private:
+	MiningScheduler &m_scheduler;
+	double m_weight;
+public:
+	EndpointClientShared(
+			std::string clientId,
+			std::string minerId,
+			std::unique_ptr<Connection> &conn,
+			std::shared_ptr<ILog> &log,
+			MiningScheduler &scheduler,
+			double weight
+		)
+		: EndpointClient(clientId, minerId, conn, log)
+		, m_scheduler(scheduler)
+		, m_weight(weight)
+	{}
+
+	virtual void MakeBid(
+		const std::shared_ptr<Packet_ServerBeginRound> roundInfo,
+		const std::shared_ptr<Packet_ServerRequestBid> request,
+		double period,
+		double skewEstimate,
+		std::vector<uint32_t> &solution,
+		uint32_t *pProof
+	) override {
+		double tSafetyMargin= SafetyMargin();
+		double tFinish=request->timeStampReceiveBids*1e-9 + skewEstimate - tSafetyMargin;
+
+		Log(Log_Verbose, "MakeBid - start, total period=%lg, weight=%lg.", period, m_weight);
+
+		auto job=m_scheduler.Open(roundInfo.get(), tFinish, m_weight,
+			[this](unsigned nIndices, const uint32_t *pIndices, const uint32_t *pProof){
+				OfferBid(nIndices, pIndices, pProof);
+			}
+		);
+
+		double t=now()*1e-9;
+		if(tFinish>t)
+			std::this_thread::sleep_for(std::chrono::duration<double>(tFinish-t));
+
+		uint64_t trials=m_scheduler.Close(job);
+		job->GetBest(solution, pProof);
+
+		if(solution.empty()){
+			// The workers never got to it, so send something that is at least valid
+			solution.resize(roundInfo->maxIndices);
+			for(unsigned j=0;j<solution.size();j++){
+				solution[j]=j+1;
+			}
+			bigint_t proof=HashReference(roundInfo.get(), solution.size(), &solution[0]);
+			wide_copy(BIGINT_WORDS, pProof, proof.limbs);
+		}
+
+		Log(Log_Verbose, "MakeBid - finish, trials=%llu.", (unsigned long long)trials);
+	}
+};
+
+}; // bitecoin
+
+// True if the whole string is a number
+static bool IsNumber(const std::string &s, double &value)
+{
+	char *end=0;
+	double v=strtod(s.c_str(), &end);
+	if(s.empty() || *end!=0)
+		return false;
+	value=v;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc<4){
+		fprintf(stderr, "bitecoin_multi_client client_id logLevel [weight] connectionType [arg1 [arg2 ...]] [+ [weight] connectionType [arg1 ...]] ...\n");
+		fprintf(stderr, "  Each connection gets its own endpoint, and the mining workers are shared between them.\n");
+		fprintf(stderr, "  The optional weight is how much a win on that exchange is worth, and defaults to 1.\n");
+		exit(1);
+	}
+
+	// We handle errors at the point of read/write
+	signal(SIGPIPE, SIG_IGN);	// Just look at error codes
+
+	try{
+		std::string clientId=argv[1];
+		std::string minerId="David's Miner";
+
+		int logLevel=atoi(argv[2]);
+		fprintf(stderr, "LogLevel = %s -> %d\n", argv[2], logLevel);
+
+		// Split the rest of the arguments into one spec per exchange
+		std::vector<std::vector<std::string> > specs(1);
+		for(int i=3;i<argc;i++){
+			if(std::string(argv[i])=="+"){
+				specs.push_back(std::vector<std::string>());
+			}else{
+				specs.back().push_back(argv[i]);
+			}
+		}
+
+		std::shared_ptr<bitecoin::ILog> logDest=std::make_shared<bitecoin::LogDest>(clientId, logLevel);
+
+		bitecoin::MiningScheduler scheduler;
+		logDest->Log(bitecoin::Log_Info, "Created scheduler with %u workers for %u exchanges.", scheduler.WorkerCount(), (unsigned)specs.size());
+
+		std::vector<std::unique_ptr<bitecoin::EndpointClientShared> > endpoints;
+		for(unsigned i=0;i<specs.size();i++){
+			std::vector<std::string> spec=specs[i];
+			double weight=1.0;
+			if(!spec.empty() && IsNumber(spec[0], weight))
+				spec.erase(spec.begin());
+			if(spec.empty())
+				throw std::invalid_argument("Empty connection spec for exchange "+std::to_string(i)+".");
+
+			std::shared_ptr<bitecoin::ILog> log=std::make_shared<bitecoin::LogDest>(clientId+"/"+std::to_string(i), logLevel);
+			std::unique_ptr<bitecoin::Connection> connection{bitecoin::OpenConnection(spec)};
+			endpoints.emplace_back(new bitecoin::EndpointClientShared(clientId, minerId, connection, log, scheduler, weight));
+		}
+
+		// Each endpoint has its own threads, and keeps going until its connection fails
+		std::vector<std::thread> threads;
+		unsigned failed=0;
+		std::mutex failedMutex;
+		for(unsigned i=0;i<endpoints.size();i++){
+			threads.push_back(std::thread([&,i](){
+				try{
+					endpoints[i]->Run();
+				}catch(std::exception &e){
+					logDest->Log(bitecoin::Log_Error, "Exchange %u failed : %s", i, e.what());
+					std::lock_guard<std::mutex> lock(failedMutex);
+					failed++;
+				}
+			}));
+		}
+		for(auto &t : threads){
+			t.join();
+		}
+
+		if(failed>0)
+			return 1;
+	}catch(std::string &msg){
+		std::cerr<<"Caught error string : "<<msg<<std::endl;
+		return 1;
+	}catch(std::exception &e){
+		std::cerr<<"Caught exception : "<<e.what()<<std::endl;
+		return 1;
+	}catch(...){
+		std::cerr<<"Caught unknown exception."<<std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -12,7 +12,7 @@
 int main(int argc, char *argv[])
 {
 	if(argc<2){
-		fprintf(stderr, "bitecoin_client client_id logLevel connectionType [arg1 [arg2 ...]]\n");
+		fprintf(stderr, "bitecoin_server server_id logLevel [seed=n] [schedule=path] connectionType [arg1 [arg2 ...]]\n");
 		exit(1);
 	}
 	
@@ -27,9 +27,10 @@ int main(int argc, char *argv[])
 			spec.push_back(argv[i]);
 		}		
 		
+		auto schedule=bitecoin::OpenRoundSchedule(spec);
 		std::unique_ptr<bitecoin::Connection> connection{bitecoin::OpenConnection(spec)};
 		
-		bitecoin::EndpointServer endpoint(clientId, minerId, connection, logLevel);
+		bitecoin::EndpointServer endpoint(clientId, minerId, connection, logLevel, schedule);
 		endpoint.Run();
 
 	}catch(std::string &msg){